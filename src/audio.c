@@ -0,0 +1,306 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "audio.h"
+
+char * audio_format_names[] = {
+	[AAC] = "aac",
+	[MP3] = "mp3",
+	[OPUS] = "opus",
+	[FLAC] = "flac",
+	[INVALID_FORMAT] = "invalid_format"
+};
+
+char * audio_source_names[] = {
+	[AUDIO_PULSE] = "pulse",
+	[AUDIO_ALSA] = "alsa",
+	[AUDIO_JACK] = "jack",
+	[AUDIO_FILE] = "file",
+	[INVALID_AUDIO_SOURCE] = "invalid_source"
+};
+
+struct audio_input_state {
+	enum audio_source source;
+	char name[32];
+	GstElement *convert;	// decodebin links here once it knows the format
+	gint buffers;
+	gint xruns;		// discontinuities after the first buffer
+};
+
+/* Each encoder runs in the streaming thread of the queue in front of it,
+ * so that thread's CPU clock is the cost of encoding. It is read by the
+ * thread itself, another thread's clock is gone once it exits. */
+struct audio_encoder {
+	GstElement *tee;
+	GstPad *teesink;
+	int64_t thread_cpu;	// atomic, us, 0 until the first buffer
+	int64_t last_cpu;
+	int64_t last_wall;
+};
+
+struct audio_frontend {
+	GstElement *mix;
+	GstElement *rawtee;
+	int count;
+	struct audio_input_state input[MAX_AUDIO_INPUTS];
+	struct audio_encoder encoder[INVALID_FORMAT];
+};
+
+/* audiobasesrc marks the first buffer after an overrun as DISCONT */
+static GstPadProbeReturn audio_xrun_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct audio_input_state *in = data;
+	GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+	if(g_atomic_int_add(&in->buffers, 1) > 0 && GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DISCONT))
+		g_atomic_int_inc(&in->xruns);
+	return GST_PAD_PROBE_OK;
+}
+
+static void audio_file_pad_added(GstElement *decode, GstPad *pad, gpointer data){
+	struct audio_input_state *in = data;
+	GstCaps *caps = gst_pad_get_current_caps(pad);
+	if(caps == NULL)
+		caps = gst_pad_query_caps(pad, NULL);
+	const gchar *media = gst_structure_get_name(gst_caps_get_structure(caps, 0));
+	if(g_str_has_prefix(media, "audio/")){
+		GstPad *convsink = gst_element_get_static_pad(in->convert, "sink");
+		if(!gst_pad_is_linked(convsink))
+			gst_pad_link(pad, convsink);
+		gst_object_unref(convsink);
+	}
+	gst_caps_unref(caps);
+}
+
+static GstElement * audio_make_source(GstElement *pipeline, struct audio_input *input,
+		uint64_t buffer_time, uint64_t latency_time){
+	GstElement *src = NULL;
+	switch(input->source){
+		case AUDIO_PULSE:
+			src = gst_element_factory_make("pulsesrc", NULL);
+			if(input->device != NULL)
+				g_object_set(G_OBJECT(src), "device", input->device, NULL);
+			break;
+		case AUDIO_ALSA:
+			src = gst_element_factory_make("alsasrc", NULL);
+			if(input->device != NULL)
+				g_object_set(G_OBJECT(src), "device", input->device, NULL);
+			break;
+		case AUDIO_JACK:
+			src = gst_element_factory_make("jackaudiosrc", NULL);
+			g_object_set(G_OBJECT(src), "client-name", "bitcorder", NULL);
+			if(input->device != NULL)
+				g_object_set(G_OBJECT(src), "port-pattern", input->device, NULL);
+			break;
+		case AUDIO_FILE:
+			src = gst_element_factory_make("filesrc", NULL);
+			g_object_set(G_OBJECT(src), "location", input->device, NULL);
+			gst_bin_add(GST_BIN(pipeline), src);
+			return src;
+		default:
+			printf("unknown audio source\n");
+			return NULL;
+	}
+	if(src == NULL){
+		printf("no element for %s audio\n", audio_source_names[input->source]);
+		return NULL;
+	}
+	g_object_set(G_OBJECT(src), "buffer-time", (gint64) buffer_time,
+		"latency-time", (gint64) latency_time, NULL);
+	gst_bin_add(GST_BIN(pipeline), src);
+	return src;
+}
+
+struct audio_frontend * audio_frontend_new(GstElement *pipeline, struct audio_input *inputs, int count,
+		uint64_t buffer_time, uint64_t latency_time){
+	struct audio_frontend *front = g_new0(struct audio_frontend, 1);
+	if(buffer_time == 0)
+		buffer_time = AUDIO_DEFAULT_BUFFER_TIME;
+	if(latency_time == 0)
+		latency_time = AUDIO_DEFAULT_LATENCY_TIME;
+	printf("audio buffer-time %lu latency-time %lu\n", (unsigned long) buffer_time, (unsigned long) latency_time);
+
+	/* mixer output is cut in latency_time pieces, and it only waits that
+	 * long again for a late input before mixing without it */
+	front->mix = gst_element_factory_make("audiomixer", "audiomix");
+	g_object_set(G_OBJECT(front->mix), "latency", (guint64) latency_time * GST_USECOND,
+		"output-buffer-duration", (guint64) latency_time * GST_USECOND, NULL);
+	GstElement *mix_filter = gst_element_factory_make("capsfilter", NULL);
+	GstCaps *mix_caps = gst_caps_new_simple("audio/x-raw",
+		"format", G_TYPE_STRING, "S16LE",
+		"rate", G_TYPE_INT, AUDIO_MIX_RATE,
+		"channels", G_TYPE_INT, AUDIO_MIX_CHANNELS, NULL);
+	g_object_set(G_OBJECT(mix_filter), "caps", mix_caps, NULL);
+	front->rawtee = gst_element_factory_make("tee", "audiorawtee");
+	gst_bin_add_many(GST_BIN(pipeline), front->mix, mix_filter, front->rawtee, NULL);
+	gst_element_link_many(front->mix, mix_filter, front->rawtee, NULL);
+
+	for(int i = 0 ; i < count && front->count < MAX_AUDIO_INPUTS ; i++){
+		struct audio_input *input = &inputs[i];
+		struct audio_input_state *in = &front->input[front->count];
+		GstElement *src = audio_make_source(pipeline, input, buffer_time, latency_time);
+		if(src == NULL)
+			continue;
+		in->source = input->source;
+		snprintf(in->name, sizeof(in->name), "%s%d", audio_source_names[input->source], front->count);
+
+		/* Convert to 16 bit before resampling, audioresample uses its
+		 * fixed point SIMD filters for integer samples */
+		in->convert = gst_element_factory_make("audioconvert", NULL);
+		GstElement *int_filter = gst_element_factory_make("capsfilter", NULL);
+		GstCaps *int_caps = gst_caps_new_simple("audio/x-raw",
+			"format", G_TYPE_STRING, "S16LE",
+			"channels", G_TYPE_INT, AUDIO_MIX_CHANNELS, NULL);
+		g_object_set(G_OBJECT(int_filter), "caps", int_caps, NULL);
+		gst_caps_unref(int_caps);
+		GstElement *resample = gst_element_factory_make("audioresample", NULL);
+		gst_bin_add_many(GST_BIN(pipeline), in->convert, int_filter, resample, NULL);
+		gst_element_link(in->convert, int_filter);
+		gst_element_link(int_filter, resample);
+		gst_element_link_filtered(resample, front->mix, mix_caps);
+
+		GstPad *resamplesrc = gst_element_get_static_pad(resample, "src");
+		GstPad *mixpad = gst_pad_get_peer(resamplesrc);
+		g_object_set(G_OBJECT(mixpad), "volume", input->gain, NULL);
+		gst_object_unref(mixpad);
+		gst_object_unref(resamplesrc);
+
+		if(input->source == AUDIO_FILE){
+			GstElement *decode = gst_element_factory_make("decodebin", NULL);
+			gst_bin_add(GST_BIN(pipeline), decode);
+			gst_element_link(src, decode);
+			g_signal_connect(decode, "pad-added", G_CALLBACK(audio_file_pad_added), in);
+		} else {
+			gst_element_link(src, in->convert);
+			GstPad *srcpad = gst_element_get_static_pad(src, "src");
+			gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_BUFFER,
+				(GstPadProbeCallback) audio_xrun_probe, in, NULL);
+			gst_object_unref(srcpad);
+		}
+		printf("audio input %s %s gain %f\n", in->name,
+			input->device != NULL ? input->device : "default", input->gain);
+		front->count++;
+	}
+	gst_caps_unref(mix_caps);
+	return front;
+}
+
+static GstPadProbeReturn audio_encoder_thread_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct audio_encoder *enc = data;
+	struct timespec ts;
+	if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+		__atomic_store_n(&enc->thread_cpu, (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000,
+			__ATOMIC_RELAXED);
+	return GST_PAD_PROBE_OK;
+}
+
+GstElement * audio_frontend_encoded(struct audio_frontend *front, GstElement *pipeline,
+		enum audio_format format, uint32_t bitrate){
+	struct audio_encoder *enc = &front->encoder[format];
+	if(enc->tee != NULL)
+		return enc->tee;
+
+	GstElement *encoder = NULL;
+	GstElement *parse = NULL;
+	GstCaps *enc_caps = NULL;
+	switch(format){
+		case AAC:
+			encoder = gst_element_factory_make("avenc_aac", NULL);
+			g_object_set(G_OBJECT(encoder), "bitrate", bitrate, NULL);
+			parse = gst_element_factory_make("aacparse", NULL);
+			enc_caps = gst_caps_new_simple("audio/mpeg", "mpegversion", G_TYPE_INT, 4,
+				"stream-format", G_TYPE_STRING, "raw", NULL);
+			break;
+		case MP3:
+			encoder = gst_element_factory_make("lamemp3enc", NULL);
+			// lame wants kbit/s
+			g_object_set(G_OBJECT(encoder), "target", 1, "bitrate", bitrate / 1000, NULL);
+			parse = gst_element_factory_make("mpegaudioparse", NULL);
+			break;
+		case OPUS:
+			encoder = gst_element_factory_make("opusenc", NULL);
+			g_object_set(G_OBJECT(encoder), "bitrate", bitrate, NULL);
+			parse = gst_element_factory_make("opusparse", NULL);
+			break;
+		case FLAC:
+			encoder = gst_element_factory_make("flacenc", NULL);
+			parse = gst_element_factory_make("flacparse", NULL);
+			break;
+		default:
+			printf("unknown audio format\n");
+			return NULL;
+	}
+	printf("audio encoder %s\n", audio_format_names[format]);
+	GstElement *encqueue = gst_element_factory_make("queue", NULL);
+	GstElement *convert = gst_element_factory_make("audioconvert", NULL);
+	GstElement *outqueue = gst_element_factory_make("queue", NULL);
+	enc->tee = gst_element_factory_make("tee", NULL);
+	gst_bin_add_many(GST_BIN(pipeline), encqueue, convert, encoder, parse, outqueue, enc->tee, NULL);
+	gst_element_link_many(front->rawtee, encqueue, convert, encoder, parse, NULL);
+	if(enc_caps != NULL){
+		gst_element_link_filtered(parse, outqueue, enc_caps);
+		gst_caps_unref(enc_caps);
+	} else {
+		gst_element_link(parse, outqueue);
+	}
+	gst_element_link(outqueue, enc->tee);
+	enc->teesink = gst_element_get_static_pad(enc->tee, "sink");
+
+	GstPad *encsink = gst_element_get_static_pad(encoder, "sink");
+	gst_pad_add_probe(encsink, GST_PAD_PROBE_TYPE_BUFFER,
+		(GstPadProbeCallback) audio_encoder_thread_probe, enc, NULL);
+	gst_object_unref(encsink);
+	return enc->tee;
+}
+
+gboolean audio_frontend_print_stats(gpointer data){
+	struct audio_frontend *front = data;
+	for(int i = 0 ; i < INVALID_FORMAT ; i++){
+		struct audio_encoder *enc = &front->encoder[i];
+		if(enc->tee == NULL)
+			continue;
+		printf("audio %s:", audio_format_names[i]);
+		GstQuery *query = gst_query_new_latency();
+		if(gst_pad_peer_query(enc->teesink, query)){
+			gboolean live;
+			GstClockTime min, max;
+			gst_query_parse_latency(query, &live, &min, &max);
+			printf(" latency %.1f ms%s", (double) min / GST_MSECOND, live ? "" : " (not live)");
+		}
+		gst_query_unref(query);
+		int64_t cpu = __atomic_load_n(&enc->thread_cpu, __ATOMIC_RELAXED);
+		if(cpu != 0){
+			int64_t wall = g_get_monotonic_time();
+			// a new streaming thread after a restart starts its clock over
+			if(enc->last_wall != 0 && cpu >= enc->last_cpu)
+				printf(" encoder cpu %.1f%%", 100.0 * (cpu - enc->last_cpu) / (wall - enc->last_wall));
+			enc->last_cpu = cpu;
+			enc->last_wall = wall;
+		}
+		printf("\n");
+	}
+	for(int i = 0 ; i < front->count ; i++){
+		struct audio_input_state *in = &front->input[i];
+		if(in->source == AUDIO_FILE)
+			continue;
+		printf("audio input %s: buffers %d xruns %d\n", in->name,
+			g_atomic_int_get(&in->buffers), g_atomic_int_get(&in->xruns));
+	}
+	return TRUE;
+}
@@ -0,0 +1,62 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITCORDER_AUDIO_H
+#define BITCORDER_AUDIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gst/gst.h>
+
+/* Audio front end. Every input is converted to the same format and mixed
+ * in one audiomixer, so mic plus desktop audio doesn't need an outside
+ * mixer. Device buffers are kept small, the defaults are about 20ms.
+ * Outputs ask for the codec they want, and each codec is only encoded once
+ * from the mixed audio no matter how many outputs use it. */
+
+#define MAX_AUDIO_INPUTS 8
+#define AUDIO_DEFAULT_BUFFER_TIME 20000		// microseconds, audiobasesrc defaults to 200000
+#define AUDIO_DEFAULT_LATENCY_TIME 5000		// and 10000
+#define AUDIO_MIX_RATE 48000
+#define AUDIO_MIX_CHANNELS 2
+
+enum audio_format { AAC = 0, MP3, OPUS, FLAC, INVALID_FORMAT };
+extern char * audio_format_names[];
+
+enum audio_source { AUDIO_PULSE = 0, AUDIO_ALSA, AUDIO_JACK, AUDIO_FILE, INVALID_AUDIO_SOURCE };
+extern char * audio_source_names[];
+
+struct audio_input {
+	enum audio_source source;
+	char * device;		// pulse source, alsa device, jack port pattern or filename
+	double gain;
+};
+
+struct audio_frontend;
+
+/* adds all of the inputs and the mixer to pipeline */
+struct audio_frontend * audio_frontend_new(GstElement *pipeline, struct audio_input *inputs, int count,
+	uint64_t buffer_time, uint64_t latency_time);
+/* tee with the mixed audio encoded as format, the encoder is added the
+ * first time a format is asked for. bitrate is in bits per second. */
+GstElement * audio_frontend_encoded(struct audio_frontend *front, GstElement *pipeline,
+	enum audio_format format, uint32_t bitrate);
+
+/* g_timeout_add callback, prints latency, xruns and encoder CPU use */
+gboolean audio_frontend_print_stats(gpointer data);
+
+#endif
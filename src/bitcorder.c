@@ -22,9 +22,26 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <string.h>
 #include <strings.h>
+#include <unistd.h>
+#include <signal.h>
 #include <gst/gst.h>
+#include <glib-unix.h>
+#include <X11/Xlib.h>
+#include "split.h"
+#include "cursor.h"
+#include "audio.h"
+#include "sync.h"
+#include "threads.h"
+#include "budget.h"
+#include "trace.h"
+#include "startup.h"
+#include "webrtc.h"
+#include "scene.h"
+#include "media.h"
+#include "rtmp.h"
 
 /* Avoiding heap allocation. This might be dumb */
 enum default_names { DFT_EMPTY = 0, DFT_LOCALHOST, DFT_EXAMPLE_COM, DFT_KEY, DFT_FLASHVER };
@@ -41,12 +58,21 @@ static char* default_strings[] = {
 const char * argp_program_bug_address = "Daniel Patrick Johnson <teknotus@gmail.com>";
 const char * argp_program_version = "zero";
 
-enum primary_opts { CAPTURE = 256, CAMERA, IMAGE, MONITOR, OUTPUT, AUDIO, VIDEO_BITRATE, AUDIO_BITRATE, RTP, RTMP, SAVE, RPI };
+enum primary_opts { CAPTURE = 256, CAMERA, IMAGE, MONITOR, OUTPUT, AUDIO, VIDEO_BITRATE, AUDIO_BITRATE, RTP, RTMP, SAVE, RPI, SPLIT, REGION, AUDIO_IN, AV_SYNC, THREADS, MEMORY, TRACE, HEADLESS, WEBRTC, SCENE, MEDIA };
 
 enum subopt_keys { XID=0, XNAME, DISPLAY, FRAMERATE, SHOW_POINTER, CHOOSE_WINDOW,
 	MONITOR_SINK, CHOOSE_DEVICE, HOST, PORT, SERVICE, URL, STREAM_KEY, TEST, FILENAME,
-	// FIXME add WIDTH, HEIGHT for camera
-	DEVICE, FOURCC, // PNG, JPEG,
+	DEVICE, FOURCC, WIDTH, HEIGHT, // PNG, JPEG,
+	ROLE, SHM_NAME, SLOTS,
+	SOURCE, GAIN, BUFFER_TIME, LATENCY_TIME, AUDIO_CODEC,
+	CORRECT, SLEW,
+	CLASS, CPUS, NICE, POLICY, PRIORITY,
+	BUDGET, FRAMES, ENCODED_MS,
+	RING,
+	PEERS, STUN, BIND,
+	LAYER, FADE,
+	URI, LOOP, DECODE_THREADS, LOOKAHEAD,
+	BACKLOG,
 	LEFT, TOP, RIGHT, BOTTOM, SCALE_WIDTH, SCALE_HEIGHT,
         XPOS, YPOS, ZORDER, ALPHA, EFFECT,
 	FORMAT,
@@ -70,6 +96,37 @@ char * subopt_names[] = {
 	[FILENAME] = "filename",
 	[DEVICE] = "device",
 	[FOURCC] = "fourcc",
+	[WIDTH] = "width", // camera capture size
+	[HEIGHT] = "height",
+	[ROLE] = "role", // split: capture or encode half
+	[SHM_NAME] = "name", // split: shared memory name
+	[SLOTS] = "slots", // split: frames in the ring
+	[SOURCE] = "source", // audio input alsa, pulse, jack, file
+	[GAIN] = "gain", // audio input volume, 1.0 is unchanged
+	[BUFFER_TIME] = "buffer_time", // audio device buffer in microseconds
+	[LATENCY_TIME] = "latency_time", // audio device period in microseconds
+	[AUDIO_CODEC] = "audio", // audio format of one output
+	[CORRECT] = "correct", // a/v sync: fix drift, not just report it
+	[SLEW] = "slew", // a/v sync: max correction in microseconds per second
+	[CLASS] = "class", // threads: capture, gl, encode, io, audio, other
+	[CPUS] = "cpus", // threads: 2-3 or 0:2:4
+	[NICE] = "nice",
+	[POLICY] = "policy", // threads: fifo or rr
+	[PRIORITY] = "priority", // threads: real time priority
+	[BUDGET] = "budget", // memory: MB for all queues
+	[FRAMES] = "frames", // memory: raw video frames per queue
+	[ENCODED_MS] = "encoded_ms", // memory: milliseconds in other queues
+	[RING] = "ring", // trace: seconds kept in memory until SIGUSR1
+	[PEERS] = "peers", // webrtc: viewers at once
+	[STUN] = "stun", // webrtc: stun://host:port
+	[BIND] = "bind", // webrtc: address for signaling, loopback by default
+	[LAYER] = "layer", // scene: window, camera, image, region0...
+	[FADE] = "fade", // scene: crossfade milliseconds
+	[URI] = "uri", // media: file name, srt://... or rtp://@:port
+	[LOOP] = "loop", // media: start over at the end of a file
+	[DECODE_THREADS] = "threads", // media: software decoder threads
+	[LOOKAHEAD] = "lookahead", // media: milliseconds decoded ahead
+	[BACKLOG] = "backlog", // rtmp: milliseconds held while reconnecting
 	/*[PNG] = "png", * Autodetected!
 	[JPEG] = "jpeg", * Wheeeeeeeeee */
 	[LEFT] = "left", // crop left right top bottom
@@ -128,23 +185,30 @@ struct window_options {
 	bool show_pointer;
 	struct composite_options composite;
 };
+#define MAX_REGIONS 8
+struct region_options {
+	uint32_t xid;				// window to take position from
+	struct composite_options composite;	// crop is the area of the screen
+};
+struct media_source_options {
+	struct media_options media;
+	struct composite_options composite;
+};
 struct output_options {				// Kind of opposite of composite
 	uint32_t framerate;
 	struct composite_options composite;	// But mostly the same stuff
 };						// Hack FIXME
-enum audio_format { AAC = 0, MP3, INVALID_FORMAT }; //FIXME add ogg flac opus
 struct audio_options {
-	enum audio_format format;
-};// FIXME add alsa/jack/pulse
-char * audio_format_names[] = {
-	[AAC] = "aac",
-	[MP3] = "mp3",
-	[INVALID_FORMAT] = "invalid_format"
+	enum audio_format format;	// for outputs that don't pick their own
+	uint64_t buffer_time;
+	uint64_t latency_time;
+	struct audio_input input[MAX_AUDIO_INPUTS];
+	int inputs;		// none means the default pulse source
 };
-
 struct rtp_options {
 	char * host;
 	uint32_t port;
+	enum audio_format audio_format;	// INVALID_FORMAT for --audio format
 };
 enum rtmp_service { YOUTUBE = 0, TWITCH, INVALID_SERVICE };
 char * rtmp_service_names[] = {
@@ -157,29 +221,110 @@ struct rtmp_options {
 	char *url;
 	char *key;
 	bool test;
+	enum audio_format audio_format;
+	uint32_t backlog_ms;	// 0 resumes from the newest keyframe
+};
+enum split_role { SPLIT_NONE = 0, SPLIT_ENCODE, SPLIT_CAPTURE };
+struct split_options {
+	enum split_role role;
+	char * name;
+	uint32_t slots;
+};
+struct sync_options {
+	bool correct;
+	uint32_t slew;
+};
+struct headless_options {
+	bool gbm;	// otherwise surfaceless
+	char * device;	// drm device for gbm
 };
 struct save_options {
 			// probably add some kind of format picking
 	char * filename;
+	enum audio_format audio_format;
 };
 struct arguments {
 	bool use_monitor;
+	bool use_window;
 	bool use_rtmp;
 	bool use_rtp;
 	bool use_save;
 	bool use_audio;
+	bool use_split;
 	uint32_t video_bitrate;
 	uint32_t audio_bitrate;
 	struct camera_options camera;
 	struct image_options image;
 	struct window_options window;
+	struct region_options region[MAX_REGIONS];
+	int regions;
 	struct output_options output;
 	struct audio_options audio;
 	struct rtp_options rtp;
 	struct rtmp_options rtmp;
 	struct save_options save;
+	struct split_options split;
+	struct sync_options sync;
+	struct thread_policy threads[INVALID_THREAD_CLASS];
+	struct memory_options memory;
+	bool use_trace;
+	struct trace_options trace;
+	bool use_headless;
+	struct headless_options headless;
+	bool use_webrtc;
+	struct webrtc_options webrtc;
+	struct scene_options scene[MAX_SCENES];
+	int scenes;
+	struct media_source_options media[MAX_MEDIA];
+	int medias;
 };
 
+/* scenes are made by the first --scene that names them */
+struct scene_options * find_scene(struct arguments *args, const char *name){
+	for(int i = 0 ; i < args->scenes ; i++){
+		if(strcmp(args->scene[i].name, name) == 0)
+			return &args->scene[i];
+	}
+	if(args->scenes >= MAX_SCENES){
+		printf("too many scenes\n");
+		return NULL;
+	}
+	struct scene_options *scene = &args->scene[args->scenes++];
+	scene->name = (char *) name;
+	scene->fade_ms = 0;
+	scene->places = 0;
+	return scene;
+}
+
+struct scene_place * find_scene_place(struct scene_options *scene, const char *layer){
+	for(int i = 0 ; i < scene->places ; i++){
+		if(strcmp(scene->place[i].layer, layer) == 0)
+			return &scene->place[i];
+	}
+	if(scene->places >= MAX_SCENE_LAYERS){
+		printf("too many layers in scene %s\n", scene->name);
+		return NULL;
+	}
+	struct scene_place *place = &scene->place[scene->places++];
+	place->layer = (char *) layer;
+	place->xpos = SCENE_UNSET;
+	place->ypos = SCENE_UNSET;
+	place->zorder = SCENE_UNSET;
+	place->alpha = -1.0;
+	return place;
+}
+
+enum audio_format find_audio_format(const char *value){
+	for(int i=0 ; i < INVALID_FORMAT ; i++){
+		if(strcasecmp(value, audio_format_names[i]) == 0){
+			printf("found format %d\n", i);
+			return i;
+		}
+	}
+	printf("unknown audio format %s\n", value);
+	return INVALID_FORMAT;
+}
+
 void parse_composite(struct arguments * args, enum primary_opts source,  enum subopt_keys key, char *value){
 	printf("parse_composite\n");
 	struct composite_options *opt = NULL;
@@ -195,6 +340,12 @@ void parse_composite(struct arguments * args, enum primary_opts source,  enum su
 		case IMAGE:
 			opt = &args->image.composite;
 			break;
+		case REGION:
+			opt = &args->region[args->regions - 1].composite;
+			break;
+		case MEDIA:
+			opt = &args->media[args->medias - 1].composite;
+			break;
 		case OUTPUT:
 			opt = &args->output.composite;
 		default:
@@ -271,6 +422,7 @@ struct arguments init_args(){
 	struct rtp_options rtpopt = { 0 };
 	struct rtmp_options rtmpopt = { 0 };
 	struct save_options saveopt = { 0 };
+	struct split_options splitopt = { 0 };
 	winopt.xid = 0;
 	winopt.xname = default_strings[DFT_EMPTY];
 	winopt.display = default_strings[DFT_EMPTY];
@@ -289,27 +441,54 @@ struct arguments init_args(){
 
 	rtpopt.host = default_strings[DFT_LOCALHOST];
 	rtpopt.port = 6970;
+	rtpopt.audio_format = INVALID_FORMAT;
 
 	rtmpopt.service = INVALID_SERVICE;
 	rtmpopt.url = default_strings[DFT_EXAMPLE_COM];
 	rtmpopt.key = default_strings[DFT_KEY];
+	rtmpopt.audio_format = INVALID_FORMAT;
+	rtmpopt.backlog_ms = RTMP_DEFAULT_BACKLOG_MS;
 
 	saveopt.filename = default_strings[DFT_EMPTY];
+	saveopt.audio_format = INVALID_FORMAT;
+
+	splitopt.role = SPLIT_NONE;
+	splitopt.name = default_strings[DFT_EMPTY];
+	splitopt.slots = SHM_RING_DEFAULT_SLOTS;
 
 	args.use_monitor = false;
+	args.use_window = false;
 	args.use_rtmp = false;
 	args.use_rtp = false;
 	args.use_save = false;
 	args.use_audio = false;
+	args.use_split = false;
 	args.video_bitrate = 0;
 	args.audio_bitrate = 0;
 	args.window = winopt;
+	args.regions = 0;
 	args.camera = camopt;
 	args.image = imgopt;
 	args.output = outopt;
 	args.rtp = rtpopt;
 	args.rtmp = rtmpopt;
 	args.save = saveopt;
+	args.split = splitopt;
+	args.sync.correct = false;
+	args.sync.slew = SYNC_DEFAULT_SLEW;
+	args.memory.budget = MEMORY_DEFAULT_BUDGET;
+	args.memory.frames = MEMORY_DEFAULT_FRAMES;
+	args.memory.encoded_ms = MEMORY_DEFAULT_ENCODED_MS;
+	args.use_headless = false;
+	args.headless.gbm = false;
+	args.headless.device = NULL;
+	args.use_webrtc = false;
+	args.webrtc.port = WEBRTC_DEFAULT_PORT;
+	args.webrtc.peers = WEBRTC_MAX_PEERS;
+	args.webrtc.stun = NULL;
+	args.webrtc.bind = WEBRTC_DEFAULT_BIND;
+	args.scenes = 0;
+	args.medias = 0;
 	return args;
 }
 
@@ -319,7 +498,7 @@ struct argp_option options[] = {
 	{ "      --win xid=...", 0, 0, OPTION_DOC, "Specify by Xwindows ID", 1 },
 	{ "      --win xname=...", 0, 0, OPTION_DOC, "Specify by Xwindows Title", 2 },
 	{ "      --win framerate=...", 0, 0, OPTION_DOC, "Frames per second", 3 },
-	{ "      --win show_pointer", 0, 0, OPTION_DOC, "include pointer in window capture", 4 },
+	{ "      --win show_pointer", 0, 0, OPTION_DOC, "draw pointer as a layer on top of window capture", 4 },
 	{ "cam", CAMERA, "device=/dev/videoX,...", 0, "Which camera to capture", 5 },
 	{ "      --cam device=...", 0, 0, OPTION_DOC, "Specify by /dev/videoX", 6 },
 	{ "      --cam framerate=...", 0, 0, OPTION_DOC, "frames per second", 7 },
@@ -327,6 +506,8 @@ struct argp_option options[] = {
 	{ "      --cam height=...", 0, 0, OPTION_DOC, "capture height", 9 },
 	{ "      --cam fourcc=...", 0, 0, OPTION_DOC, "Example YUY2", 10 },
 	{ "img", IMAGE, "filename=exampe.png", 0, "filename for static image png/jpeg", 11 },
+	{ "region", REGION, "left=...,top=...", 0, "part of the screen, can be given several times", 11 },
+	{ "      --region xid=...", 0, 0, OPTION_DOC, "area of window at startup instead of left/top/right/bottom", 11 },
 	{ "out", OUTPUT, "filename=vid.mkv,scale_...", 0, "output filters/filename", 12 },
 	{ "Common options win, cam, img, out", 0, 0, OPTION_DOC, "Compositing", 13 },
 	{ "  left=...", 0, 0, OPTION_DOC, "x of left crop", 14 },
@@ -343,15 +524,56 @@ struct argp_option options[] = {
 	{ "  alpha=...", 0, 0, OPTION_DOC, "alpha blend value in composite", 25 },
 	{ "vid_rate", VIDEO_BITRATE, "...", 0, "video bitrate",  26 },
 	{ "aud_rate", AUDIO_BITRATE, "...", 0, "audio bitrate", 27 },
-	{ "audio", AUDIO, "format=mp3", 0, "audio encoding format", 28 },
+	{ "audio", AUDIO, "format=mp3", 0, "audio encoding format for outputs without audio=...", 28 },
+	{ "      --audio buffer_time=...", 0, 0, OPTION_DOC, "audio device buffer in microseconds", 28 },
+	{ "      --audio latency_time=...", 0, 0, OPTION_DOC, "audio device period in microseconds", 28 },
+	{ "audio_in", AUDIO_IN, "source=pulse,...", 0, "audio input, can be given several times", 28 },
+	{ "      --audio_in source=...", 0, 0, OPTION_DOC, "alsa, pulse, jack or file", 28 },
+	{ "      --audio_in device=...", 0, 0, OPTION_DOC, "device, jack port pattern or filename", 28 },
+	{ "      --audio_in gain=...", 0, 0, OPTION_DOC, "volume of this input, 1.0 is unchanged", 28 },
 	{ "rtp", RTP, "host=...,port...", 0, "stream to real time protocol", 29 },
 	{ "      --rtp host=...", 0, 0, OPTION_DOC, "hostname or IP address", 30 },
 	{ "      --rtp port=...", 0, 0, OPTION_DOC, "port IETF rec 6970...6999", 31 },
+	{ "      --rtp audio=...", 0, 0, OPTION_DOC, "aac, mp3 or opus", 31 },
 	{ "rtmp", RTMP, "url=...,key...", 0, "Stream video to distribution network", 32 },
 	{ "      --rtmp service=...", 0, 0, OPTION_DOC, "youtube or twitch", 33 },
 	{ "      --rtmp url=...", 0, 0, OPTION_DOC, "rtmp://...", 34 },
 	{ "      --rtmp key=...", 0, 0, OPTION_DOC, "XXXX-XXXX-XXXX-XXXX", 35 },
+	{ "      --rtmp audio=...", 0, 0, OPTION_DOC, "aac or mp3", 35 },
+	{ "      --rtmp backlog=...", 0, 0, OPTION_DOC, "milliseconds kept while reconnecting, 0 for the newest keyframe on", 35 },
 	{ "save", SAVE, "filename=...mkv", 0, "save video to file", 36 },
+	{ "      --save audio=...", 0, 0, OPTION_DOC, "aac, mp3, opus or flac", 36 },
+	{ "split", SPLIT, "name=...", OPTION_ARG_OPTIONAL, "capture and encode in separate processes", 37 },
+	{ "      --split=name=...", 0, 0, OPTION_DOC, "shared memory name", 38 },
+	{ "      --split=slots=...", 0, 0, OPTION_DOC, "frames in shared memory ring", 39 },
+	{ "avsync", AV_SYNC, "correct,...", 0, "audio/video drift at the muxers", 40 },
+	{ "      --avsync correct", 0, 0, OPTION_DOC, "shift video timestamps to follow audio drift", 41 },
+	{ "      --avsync slew=...", 0, 0, OPTION_DOC, "max correction microseconds per second", 42 },
+	{ "threads", THREADS, "class=audio,...", 0, "cpus and scheduling for one class of streaming threads", 43 },
+	{ "      --threads class=...", 0, 0, OPTION_DOC, "capture, gl, encode, io, audio or other", 44 },
+	{ "      --threads cpus=...", 0, 0, OPTION_DOC, "cpu numbers like 2-3 or 0:2:4", 45 },
+	{ "      --threads nice=...", 0, 0, OPTION_DOC, "nice value", 46 },
+	{ "      --threads policy=...,priority=...", 0, 0, OPTION_DOC, "fifo or rr real time priority", 47 },
+	{ "memory", MEMORY, "budget=...", 0, "limits for every queue", 48 },
+	{ "      --memory budget=...", 0, 0, OPTION_DOC, "MB of raw video in all queues together, then frames are skipped", 49 },
+	{ "      --memory frames=...", 0, 0, OPTION_DOC, "raw video frames per queue", 50 },
+	{ "      --memory encoded_ms=...", 0, 0, OPTION_DOC, "milliseconds of audio and encoded video per queue", 51 },
+	{ "trace", TRACE, "file.json", 0, "timeline of every buffer for Perfetto or chrome://tracing", 52 },
+	{ "      --trace=file.json,ring=...", 0, 0, OPTION_DOC, "keep seconds in memory, each SIGUSR1 writes file.N.json", 53 },
+	{ "headless", HEADLESS, "surfaceless", OPTION_ARG_OPTIONAL, "composite offscreen with EGL, no preview window", 54 },
+	{ "      --headless=gbm,device=...", 0, 0, OPTION_DOC, "render on a drm device instead, like /dev/dri/card0", 55 },
+	{ "webrtc", WEBRTC, "port=...", OPTION_ARG_OPTIONAL, "browser viewers over WebRTC, signaling on http://host:port/", 56 },
+	{ "      --webrtc peers=...", 0, 0, OPTION_DOC, "viewers at once", 57 },
+	{ "      --webrtc stun=...", 0, 0, OPTION_DOC, "stun://host:port when viewers are outside the LAN", 58 },
+	{ "      --webrtc bind=...", 0, 0, OPTION_DOC, "address to listen on, 127.0.0.1 by default, no authentication!", 58 },
+	{ "scene", SCENE, "name=...,layer=...", 0, "where one layer goes in a named scene, give it for each layer", 59 },
+	{ "      --scene name=...,layer=...,xpos=...,ypos=...,zorder=...,alpha=...", 0, 0, OPTION_DOC, "layers left out are hidden", 60 },
+	{ "      --scene name=...,fade=...", 0, 0, OPTION_DOC, "crossfade milliseconds into this scene", 61 },
+	{ "      (scene name on stdin or SIGUSR2)", 0, 0, OPTION_DOC, "switch scenes while running", 62 },
+	{ "media", MEDIA, "uri=...", 0, "video file or stream as a layer, can be given several times", 63 },
+	{ "      --media uri=...", 0, 0, OPTION_DOC, "file name, srt://host:port or rtp://@:port with MPEG-TS like --rtp sends", 64 },
+	{ "      --media loop", 0, 0, OPTION_DOC, "start a file over when it ends, otherwise the last frame stays", 65 },
+	{ "      --media threads=...,lookahead=...", 0, 0, OPTION_DOC, "software decoder threads, milliseconds decoded ahead", 66 },
 	{ 0 }
 };
 error_t argp_callback(int key, char *arg, struct argp_state *state){
@@ -370,6 +592,7 @@ error_t argp_callback(int key, char *arg, struct argp_state *state){
 	switch(key) {
 	case CAPTURE:
 		printf("capture window\n");
+		arrrgs->use_window = true;
 		while(*subopts != '\0'){
 			subkey = getsubopt(&subopts, subopt_names, &value);
 			printf("subkey: %d value: %s\n", subkey, value);
@@ -438,12 +661,23 @@ error_t argp_callback(int key, char *arg, struct argp_state *state){
 					printf("FRAMERATE: as number %d\n", num);
 					arrrgs->camera.framerate = num;
 				}
+				break;
 			case FOURCC:
 				if(value != NULL){
 					printf("FOURCC: %s\n", value);
 					arrrgs->camera.fourcc = value;
 				}
 				break;
+			case WIDTH:
+				if(value != NULL){
+					arrrgs->camera.width = strtol(value, NULL, 0);
+				}
+				break;
+			case HEIGHT:
+				if(value != NULL){
+					arrrgs->camera.height = strtol(value, NULL, 0);
+				}
+				break;
 			default:
 				printf("camera option: %d not implemented yet\n", subkey);
 			}
@@ -469,6 +703,36 @@ error_t argp_callback(int key, char *arg, struct argp_state *state){
 			}
 		}
 		break;
+	case REGION:
+		printf("region\n");
+		if(arrrgs->regions >= MAX_REGIONS){
+			printf("too many regions, only %d allowed\n", MAX_REGIONS);
+			break;
+		}
+		arrrgs->region[arrrgs->regions].composite.alpha = 1.0;
+		arrrgs->region[arrrgs->regions].composite.type = REGION;
+		arrrgs->regions++;
+		while(*subopts != '\0'){
+			subkey = getsubopt(&subopts, subopt_names, &value);
+			printf("subkey: %d value: %s\n", subkey, value);
+			if(subkey >= LEFT){
+				printf("Common option %d\n", subkey);
+				parse_composite(arrrgs, key, subkey, value);
+			}
+			else
+			switch(subkey){
+			case XID:
+				if(value != NULL){
+					num = strtol(value, NULL, 0);
+					printf("region XID 0x%08x\n", num);
+					arrrgs->region[arrrgs->regions - 1].xid = num;
+				}
+				break;
+			default:
+				printf("region option: %d not implemented yet\n", subkey);
+			}
+		}
+		break;
 	case OUTPUT:
 		printf("output\n");
 		while(*subopts != '\0'){
@@ -499,19 +763,71 @@ error_t argp_callback(int key, char *arg, struct argp_state *state){
 			case FORMAT:
 				if(value != NULL){
 					printf("FORMAT: %s\n", value);
-					for(int i=0 ; i < 2 ; i++){
-						if(strcasecmp(value, audio_format_names[i]) == 0){
-							printf("found format %d\n", i);
-							arrrgs->audio.format = i;
+					enum audio_format format = find_audio_format(value);
+					if(format != INVALID_FORMAT)
+						arrrgs->audio.format = format;
+				}
+				break;
+			case BUFFER_TIME:
+				if(value != NULL){
+					arrrgs->audio.buffer_time = strtoull(value, NULL, 0);
+				}
+				break;
+			case LATENCY_TIME:
+				if(value != NULL){
+					arrrgs->audio.latency_time = strtoull(value, NULL, 0);
+				}
+				break;
+			default:
+				printf("audio unknown option\n");
+			}
+		}
+		break;
+	case AUDIO_IN:
+		printf("audio input\n");
+		if(arrrgs->audio.inputs >= MAX_AUDIO_INPUTS){
+			printf("too many audio inputs, max %d\n", MAX_AUDIO_INPUTS);
+			break;
+		}
+		struct audio_input *input = &arrrgs->audio.input[arrrgs->audio.inputs++];
+		input->source = AUDIO_PULSE;
+		input->device = NULL;
+		input->gain = 1.0;
+		while(*subopts != '\0'){
+			subkey = getsubopt(&subopts, subopt_names, &value);
+			printf("subkey: %d value: %s\n", subkey, value);
+			switch(subkey){
+			case SOURCE:
+				if(value != NULL){
+					printf("SOURCE: %s\n", value);
+					for(int i=0 ; i < INVALID_AUDIO_SOURCE ; i++){
+						if(strcasecmp(value, audio_source_names[i]) == 0){
+							input->source = i;
 							break;
 						}
 					}
 				}
 				break;
+			case DEVICE:
+			case FILENAME:
+				if(value != NULL){
+					printf("DEVICE: %s\n", value);
+					input->device = value;
+				}
+				break;
+			case GAIN:
+				if(value != NULL){
+					input->gain = strtod(value, NULL);
+				}
+				break;
 			default:
-				printf("audio unknown option\n");
+				printf("audio input unknown option\n");
 			}
 		}
+		if(input->source == AUDIO_FILE && input->device == NULL){
+			printf("audio file input needs filename=...\n");
+			arrrgs->audio.inputs--;
+		}
 		break;
 	case VIDEO_BITRATE:
 		arrrgs->video_bitrate = strtol(subopts, NULL, 0);
@@ -539,6 +855,11 @@ error_t argp_callback(int key, char *arg, struct argp_state *state){
 					arrrgs->rtp.port = strtol(value, NULL, 0);
 				}
 				break;
+			case AUDIO_CODEC:
+				if(value != NULL){
+					arrrgs->rtp.audio_format = find_audio_format(value);
+				}
+				break;
 			}
 		}
 		break;
@@ -577,6 +898,16 @@ error_t argp_callback(int key, char *arg, struct argp_state *state){
 			case TEST:
 				arrrgs->rtmp.test = true;
 				break;
+			case AUDIO_CODEC:
+				if(value != NULL){
+					arrrgs->rtmp.audio_format = find_audio_format(value);
+				}
+				break;
+			case BACKLOG:
+				if(value != NULL){
+					arrrgs->rtmp.backlog_ms = strtol(value, NULL, 0);
+				}
+				break;
 			}
 		}
 		break;
@@ -594,11 +925,333 @@ error_t argp_callback(int key, char *arg, struct argp_state *state){
 					arrrgs->save.filename = value;
 				}
 				break;
+			case AUDIO_CODEC:
+				if(value != NULL){
+					arrrgs->save.audio_format = find_audio_format(value);
+				}
+				break;
 			default:
 				printf("unknown save option\n");
 			}
 		}
 		break;
+	case SPLIT:
+		printf("SPLIT\n");
+		arrrgs->use_split = true;
+		if(arrrgs->split.role == SPLIT_NONE)
+			arrrgs->split.role = SPLIT_ENCODE;
+		while(*subopts != '\0'){
+			subkey = getsubopt(&subopts, subopt_names, &value);
+			printf("subkey: %d value: %s\n", subkey, value);
+			switch(subkey){
+			case ROLE:
+				if(value != NULL){
+					printf("ROLE: %s\n", value);
+					if(strcasecmp(value, "capture") == 0)
+						arrrgs->split.role = SPLIT_CAPTURE;
+					else
+						arrrgs->split.role = SPLIT_ENCODE;
+				}
+				break;
+			case SHM_NAME:
+				if(value != NULL){
+					printf("NAME: %s\n", value);
+					arrrgs->split.name = value;
+				}
+				break;
+			case SLOTS:
+				if(value != NULL){
+					arrrgs->split.slots = strtol(value, NULL, 0);
+				}
+				break;
+			default:
+				printf("unknown split option\n");
+			}
+		}
+		break;
+	case AV_SYNC:
+		printf("AV_SYNC\n");
+		while(*subopts != '\0'){
+			subkey = getsubopt(&subopts, subopt_names, &value);
+			printf("subkey: %d value: %s\n", subkey, value);
+			switch(subkey){
+			case CORRECT:
+				arrrgs->sync.correct = true;
+				break;
+			case SLEW:
+				if(value != NULL){
+					arrrgs->sync.slew = strtol(value, NULL, 0);
+				}
+				break;
+			default:
+				printf("unknown avsync option\n");
+			}
+		}
+		break;
+	case THREADS:
+		printf("THREADS\n");
+		{
+			/* class can come anywhere, so collect everything first */
+			struct thread_policy policy = { 0 };
+			enum thread_class class = INVALID_THREAD_CLASS;
+			while(*subopts != '\0'){
+				subkey = getsubopt(&subopts, subopt_names, &value);
+				printf("subkey: %d value: %s\n", subkey, value);
+				if(value == NULL){
+					printf("threads option needs a value\n");
+					continue;
+				}
+				switch(subkey){
+				case CLASS:
+					for(int i=0 ; i < INVALID_THREAD_CLASS ; i++){
+						if(strcasecmp(value, thread_class_names[i]) == 0){
+							class = i;
+							break;
+						}
+					}
+					break;
+				case CPUS:
+					policy.use_cpus = thread_parse_cpus(value, &policy.cpus);
+					if(!policy.use_cpus)
+						printf("bad cpus %s\n", value);
+					break;
+				case NICE:
+					policy.sched = SCHED_NICE;
+					policy.nice = strtol(value, NULL, 0);
+					break;
+				case POLICY:
+					if(strcasecmp(value, "fifo") == 0)
+						policy.sched = SCHED_FIFO_RT;
+					else if(strcasecmp(value, "rr") == 0)
+						policy.sched = SCHED_RR_RT;
+					else
+						printf("unknown scheduling policy %s\n", value);
+					break;
+				case PRIORITY:
+					policy.priority = strtol(value, NULL, 0);
+					break;
+				default:
+					printf("unknown threads option\n");
+				}
+			}
+			if(class == INVALID_THREAD_CLASS){
+				printf("threads needs class=...\n");
+				break;
+			}
+			if((policy.sched == SCHED_FIFO_RT || policy.sched == SCHED_RR_RT) && policy.priority == 0)
+				policy.priority = 1;
+			arrrgs->threads[class] = policy;
+		}
+		break;
+	case MEMORY:
+		printf("MEMORY\n");
+		while(*subopts != '\0'){
+			subkey = getsubopt(&subopts, subopt_names, &value);
+			printf("subkey: %d value: %s\n", subkey, value);
+			switch(subkey){
+			case BUDGET:
+				if(value != NULL){
+					arrrgs->memory.budget = strtol(value, NULL, 0);
+				}
+				break;
+			case FRAMES:
+				if(value != NULL){
+					arrrgs->memory.frames = strtol(value, NULL, 0);
+				}
+				break;
+			case ENCODED_MS:
+				if(value != NULL){
+					arrrgs->memory.encoded_ms = strtol(value, NULL, 0);
+				}
+				break;
+			default:
+				printf("unknown memory option\n");
+			}
+		}
+		break;
+	case TRACE:
+		printf("TRACE\n");
+		while(*subopts != '\0'){
+			subkey = getsubopt(&subopts, subopt_names, &value);
+			printf("subkey: %d value: %s\n", subkey, value);
+			switch(subkey){
+			case FILENAME:
+				if(value != NULL){
+					arrrgs->use_trace = true;
+					arrrgs->trace.filename = value;
+				}
+				break;
+			case RING:
+				if(value != NULL){
+					arrrgs->trace.ring = strtol(value, NULL, 0);
+				}
+				break;
+			default:
+				/* a bare name is the file, getsubopt hands back the whole thing */
+				if(value != NULL && strchr(value, '=') == NULL){
+					arrrgs->use_trace = true;
+					arrrgs->trace.filename = value;
+				} else {
+					printf("unknown trace option\n");
+				}
+			}
+		}
+		break;
+	case HEADLESS:
+		printf("HEADLESS\n");
+		arrrgs->use_headless = true;
+		while(*subopts != '\0'){
+			subkey = getsubopt(&subopts, subopt_names, &value);
+			printf("subkey: %d value: %s\n", subkey, value);
+			switch(subkey){
+			case DEVICE:
+				if(value != NULL){
+					arrrgs->headless.gbm = true;
+					arrrgs->headless.device = value;
+				}
+				break;
+			default:
+				if(value != NULL && strcasecmp(value, "gbm") == 0){
+					arrrgs->headless.gbm = true;
+				} else if(value != NULL && strcasecmp(value, "surfaceless") == 0){
+					arrrgs->headless.gbm = false;
+				} else {
+					printf("unknown headless option\n");
+				}
+			}
+		}
+		break;
+	case WEBRTC:
+		printf("WEBRTC\n");
+		arrrgs->use_webrtc = true;
+		while(*subopts != '\0'){
+			subkey = getsubopt(&subopts, subopt_names, &value);
+			printf("subkey: %d value: %s\n", subkey, value);
+			switch(subkey){
+			case PORT:
+				if(value != NULL){
+					arrrgs->webrtc.port = strtol(value, NULL, 0);
+				}
+				break;
+			case PEERS:
+				if(value != NULL){
+					arrrgs->webrtc.peers = strtol(value, NULL, 0);
+				}
+				break;
+			case STUN:
+				if(value != NULL){
+					arrrgs->webrtc.stun = value;
+				}
+				break;
+			case BIND:
+				if(value != NULL){
+					arrrgs->webrtc.bind = value;
+				}
+				break;
+			default:
+				printf("unknown webrtc option\n");
+			}
+		}
+		break;
+	case SCENE:
+		printf("SCENE\n");
+		{
+			struct scene_options *scene = NULL;
+			struct scene_place *place = NULL;
+			while(*subopts != '\0'){
+				subkey = getsubopt(&subopts, subopt_names, &value);
+				printf("subkey: %d value: %s\n", subkey, value);
+				if(value == NULL)
+					continue;
+				if(subkey != SHM_NAME && scene == NULL){
+					printf("scene name=... comes first\n");
+					continue;
+				}
+				if((subkey == XPOS || subkey == YPOS || subkey == ZORDER || subkey == ALPHA) && place == NULL){
+					printf("scene layer=... comes before where it goes\n");
+					continue;
+				}
+				switch(subkey){
+				case SHM_NAME:
+					scene = find_scene(arrrgs, value);
+					break;
+				case LAYER:
+					place = find_scene_place(scene, value);
+					break;
+				case FADE:
+					scene->fade_ms = strtol(value, NULL, 0);
+					break;
+				case XPOS:
+					place->xpos = strtol(value, NULL, 0);
+					break;
+				case YPOS:
+					place->ypos = strtol(value, NULL, 0);
+					break;
+				case ZORDER:
+					place->zorder = strtol(value, NULL, 0);
+					break;
+				case ALPHA:
+					place->alpha = strtod(value, NULL);
+					break;
+				default:
+					printf("unknown scene option\n");
+				}
+			}
+		}
+		break;
+	case MEDIA:
+		printf("media\n");
+		if(arrrgs->medias >= MAX_MEDIA){
+			printf("too many media layers, only %d allowed\n", MAX_MEDIA);
+			break;
+		}
+		{
+			struct media_source_options *media = &arrrgs->media[arrrgs->medias];
+			media->media.uri = NULL;
+			media->media.loop = false;
+			media->media.threads = MEDIA_DEFAULT_THREADS;
+			media->media.lookahead_ms = MEDIA_DEFAULT_LOOKAHEAD_MS;
+			media->composite.alpha = 1.0;
+			media->composite.type = MEDIA;
+		}
+		arrrgs->medias++;
+		while(*subopts != '\0'){
+			subkey = getsubopt(&subopts, subopt_names, &value);
+			printf("subkey: %d value: %s\n", subkey, value);
+			if(subkey >= LEFT){
+				printf("Common option %d\n", subkey);
+				parse_composite(arrrgs, key, subkey, value);
+			}
+			else
+			switch(subkey){
+			case URI:
+				if(value != NULL){
+					printf("URI: %s\n", value);
+					arrrgs->media[arrrgs->medias - 1].media.uri = value;
+				}
+				break;
+			case LOOP:
+				arrrgs->media[arrrgs->medias - 1].media.loop = true;
+				break;
+			case DECODE_THREADS:
+				if(value != NULL){
+					arrrgs->media[arrrgs->medias - 1].media.threads = strtol(value, NULL, 0);
+				}
+				break;
+			case LOOKAHEAD:
+				if(value != NULL){
+					arrrgs->media[arrrgs->medias - 1].media.lookahead_ms = strtol(value, NULL, 0);
+				}
+				break;
+			default:
+				printf("media option: %d not implemented yet\n", subkey);
+			}
+		}
+		if(arrrgs->media[arrrgs->medias - 1].media.uri == NULL){
+			printf("media needs uri=...\n");
+			arrrgs->medias--;
+		}
+		break;
 	case ARGP_KEY_END:
 		printf("END\n");
 		break;
@@ -622,7 +1275,132 @@ error_t argp_callback(int key, char *arg, struct argp_state *state){
 	}
 	return 0;
 }
-GstElement * add_composite_pipeline(GstElement *pipeline, GstElement *mixer, struct composite_options *opt){
+/* Every layer runs at its own rate. The queue at the start of each layer
+ * only keeps the newest frame, dropping stale ones before they are
+ * uploaded, and the mixer shows the last frame it got from a layer until a
+ * new one arrives. So the output runs at its own rate and a slow camera
+ * doesn't hold back a fast desktop. */
+#define MAX_LAYERS (MAX_REGIONS + MAX_MEDIA + 4)
+struct layer_stats {
+	const char *name;
+	gint arrived;		// frames that reached the mixer
+	gint shown;		// arrived as of the last output frame
+	gint repeated;		// output frames that reused the previous frame
+	gint dropped;		// stale frames thrown away
+};
+static struct layer_stats layer_stats[MAX_LAYERS];
+static int layer_count = 0;
+static struct scene_set *scenes = NULL;
+static struct media_layer *media_layers[MAX_MEDIA];
+static int media_layer_count = 0;
+
+static void layer_queue_overrun(GstElement *queue, gpointer data){
+	struct layer_stats *stats = data;
+	g_atomic_int_inc(&stats->dropped);
+}
+
+GstPadProbeReturn layer_arrived_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct layer_stats *stats = data;
+	g_atomic_int_inc(&stats->arrived);
+	return GST_PAD_PROBE_OK;
+}
+
+GstPadProbeReturn mixer_output_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	for(int i = 0 ; i < layer_count ; i++){
+		struct layer_stats *stats = &layer_stats[i];
+		gint arrived = g_atomic_int_get(&stats->arrived);
+		if(arrived == 0)
+			continue;
+		if(arrived == stats->shown)
+			stats->repeated++;
+		else if(arrived > stats->shown + 1)
+			g_atomic_int_add(&stats->dropped, arrived - stats->shown - 1);
+		stats->shown = arrived;
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+gboolean print_layer_stats(gpointer data){
+	for(int i = 0 ; i < layer_count ; i++){
+		struct layer_stats *stats = &layer_stats[i];
+		if(stats->arrived == 0)
+			continue;
+		printf("layer %s: frames %d repeated %d dropped %d\n", stats->name,
+			stats->arrived, stats->repeated, g_atomic_int_get(&stats->dropped));
+	}
+	return TRUE;
+}
+
+void add_layer_stats(const char *name, GstElement *queue, GstPad *mixpad){
+	g_object_set(G_OBJECT(queue), "leaky", 2 /* downstream */, "max-size-buffers", 1,
+		"max-size-bytes", 0, "max-size-time", (guint64) 0, NULL);
+	if(layer_count >= MAX_LAYERS)
+		return;
+	struct layer_stats *stats = &layer_stats[layer_count++];
+	stats->name = name;
+	g_signal_connect(queue, "overrun", G_CALLBACK(layer_queue_overrun), stats);
+	gst_pad_add_probe(mixpad, GST_PAD_PROBE_TYPE_BUFFER,
+		(GstPadProbeCallback) layer_arrived_probe, stats, NULL);
+}
+
+/* with no --scene every layer just stays where its options put it */
+void add_scene_layer(const char *name, GstPad *mixpad, struct composite_options *opt,
+		scene_place_func place, gpointer data){
+	if(scenes == NULL)
+		return;
+	struct scene_state home = { opt->xpos, opt->ypos, opt->zorder, opt->alpha };
+	scene_add_layer(scenes, name, mixpad, &home, place, data);
+}
+
+/* v4l2src with the camera's size, rate and fourcc. Compressed formats are
+ * decoded here since every layer needs raw frames for the mixer. */
+GstElement * add_camera_source(GstElement *pipeline, struct camera_options *camopt){
+	GstElement *cam = gst_element_factory_make("v4l2src", NULL);
+	GstElement *last_element = cam;
+	GstStructure *cam_struct;
+	g_object_set(G_OBJECT(cam), "device", camopt->device, NULL);
+	gst_bin_add(GST_BIN(pipeline), cam);
+
+	if(camopt->fourcc != NULL && strcasecmp(camopt->fourcc, "MJPG") == 0){
+		cam_struct = gst_structure_new_empty("image/jpeg");
+	} else if(camopt->fourcc != NULL && strcasecmp(camopt->fourcc, "H264") == 0){
+		cam_struct = gst_structure_new_empty("video/x-h264");
+	} else {
+		cam_struct = gst_structure_new_empty("video/x-raw");
+		if(camopt->fourcc != NULL)
+			gst_structure_set(cam_struct, "format", G_TYPE_STRING, camopt->fourcc, NULL);
+	}
+	if(camopt->width > 0 && camopt->height > 0)
+		gst_structure_set(cam_struct, "width", G_TYPE_INT, camopt->width,
+			"height", G_TYPE_INT, camopt->height, NULL);
+	if(camopt->framerate > 0)
+		gst_structure_set(cam_struct, "framerate", GST_TYPE_FRACTION, camopt->framerate, 1, NULL);
+
+	GstElement *cam_filter = gst_element_factory_make("capsfilter", NULL);
+	GstCaps *cam_caps = gst_caps_new_full(cam_struct, NULL);
+	g_object_set(G_OBJECT(cam_filter), "caps", cam_caps, NULL);
+	gst_caps_unref(cam_caps);
+	gst_bin_add(GST_BIN(pipeline), cam_filter);
+	gst_element_link(last_element, cam_filter);
+	last_element = cam_filter;
+
+	if(camopt->fourcc != NULL && strcasecmp(camopt->fourcc, "MJPG") == 0){
+		GstElement *jpegdec = gst_element_factory_make("jpegdec", NULL);
+		gst_bin_add(GST_BIN(pipeline), jpegdec);
+		gst_element_link(last_element, jpegdec);
+		last_element = jpegdec;
+	} else if(camopt->fourcc != NULL && strcasecmp(camopt->fourcc, "H264") == 0){
+		GstElement *parse = gst_element_factory_make("h264parse", NULL);
+		GstElement *h264dec = gst_element_factory_make("avdec_h264", NULL);
+		gst_bin_add_many(GST_BIN(pipeline), parse, h264dec, NULL);
+		gst_element_link_many(last_element, parse, h264dec, NULL);
+		last_element = h264dec;
+	}
+	return last_element;
+}
+
+GstElement * add_composite_pipeline(GstElement *pipeline, GstElement *mixer, const char *name,
+		struct composite_options *opt, GstPad **mixpad){
 	// FIXME free or save pointers
 	GstElement * last_element;
 
@@ -644,7 +1422,8 @@ GstElement * add_composite_pipeline(GstElement *pipeline, GstElement *mixer, str
 	gst_element_link_many(last_element, winup, colorcvt, NULL);
 	last_element = colorcvt;
 
-	if(opt->use_scale){
+	// window layers are scaled by the mixer itself, see window_resize_probe
+	if(opt->use_scale && (opt->type != CAPTURE)){
 		printf("Using scale\n");
 		GstElement *colorscale = gst_element_factory_make("glcolorscale", NULL);
 		GstCaps *resize_caps;
@@ -672,6 +1451,12 @@ GstElement * add_composite_pipeline(GstElement *pipeline, GstElement *mixer, str
 	GstPad *mixpad0 = gst_pad_get_peer(capspad);
 	g_object_set(G_OBJECT(mixpad0), "xpos", opt->xpos, "ypos", opt->ypos, "zorder", opt->zorder,
 		"alpha", opt->alpha, NULL);
+	add_layer_stats(name, vidqueue, mixpad0);
+	// the window places itself, see window_layer_place
+	if(opt->type != CAPTURE)
+		add_scene_layer(name, mixpad0, opt, NULL, NULL);
+	if(mixpad != NULL)
+		*mixpad = mixpad0;
 	return vidqueue;
 }
 static void image_decode_new_pad (GstElement *dec, GstPad *decpad, gpointer usrptr){
@@ -733,176 +1518,489 @@ GstPadProbeReturn block_caps_probe (GstPad *pad, GstPadProbeInfo *info, gpointer
 	return GST_PAD_PROBE_OK;
 }
 
-int main(int argc, char *argv[])
-{
-	uint32_t default_audio_bitrate = 128000;
-	uint32_t default_rtp_port = 6970;
-	char doc[] = "I bet this program does something useful.";
-	char more_doc[] = "what does this do?";
-	struct arguments arrrgs = init_args();
-	struct argp argp_stuff = { options, argp_callback, more_doc, doc, 0, 0, 0};
-	argp_parse(&argp_stuff, argc, argv, 0, 0, &arrrgs);
-	printf("Parsed Options\n");
-	printf("xid: 0x%08x\n", arrrgs.window.xid);
-	printf("xname: %s\n", arrrgs.window.xname);
-	printf("display: %s\n", arrrgs.window.display);
-	printf("framerate: %d\n", arrrgs.window.framerate);
-	printf("pointer: %s\n", arrrgs.window.show_pointer ? "TRUE" : "FALSE");
-	printf("video_bitrate: %d\n", arrrgs.video_bitrate);
-	printf("audio_bitrate: %d\n", arrrgs.audio_bitrate);
-	printf("use_rtp: %s\n", arrrgs.use_rtp ? "TRUE" : "FALSE");
-	printf("rtp host: %s\n", arrrgs.rtp.host);
-	printf("rtp port: %d\n", arrrgs.rtp.port);
-	printf("use_rtmp: %s\n", arrrgs.use_rtmp ? "TRUE" : "FALSE");
-	printf("rtmp service: %s\n", rtmp_service_names[arrrgs.rtmp.service]);
-	printf("rtmp url: %s\n", arrrgs.rtmp.url);
-	printf("rtmp stream_key: %s\n", arrrgs.rtmp.key);
-	printf("window composite use crop: %s\n", arrrgs.window.composite.use_crop ? "TRUE" : "FALSE");
-	printf("window composite left: %d\n", arrrgs.window.composite.left);
-	printf("output scale_width: %d\n", arrrgs.output.composite.scale_width);
-	if(arrrgs.use_save){
-		printf("save filename: %s\n", arrrgs.save.filename);
+/* Window layers keep a fixed box in the composite. A resized window is
+ * letterboxed into its box by the mixer on the GPU, and the mixer output is
+ * pinned to its first size, so nothing after the mixer renegotiates. The
+ * layer itself, ximagesrc up to the mixer pad, still does for each new size.
+ * Dragging a window edge makes every frame a new size, so hold frames back
+ * until the size settles instead of reallocating glupload for each one. */
+#define WINDOW_SETTLE_FRAMES 3
+struct window_layer {
+	/* the capture thread resizes, the mixer thread places it for scenes */
+	GMutex lock;
+	struct composite_options *opt;
+	GstPad *mixpad;
+	int32_t box_width;	// from scale_width/scale_height or the first size
+	int32_t box_height;
+	int32_t width;		// current window size
+	int32_t height;
+	int settle;		// frames left to hold back
+	bool pending;		// new size not shown in the mixer yet
+	uint32_t resizes;
+	uint32_t held;
+	int32_t shown_x;	// where the window is drawn inside its box
+	int32_t shown_y;
+	double scale_x;		// drawn size over window size
+	double scale_y;
+	double alpha;
+	unsigned int zorder;
+	struct cursor_layer *cursor;
+};
+
+/* the pointer goes where the window is drawn and shrinks with it, called locked */
+static void window_layer_cursor(struct window_layer *layer){
+	if(layer->cursor != NULL)
+		cursor_layer_place(layer->cursor, layer->shown_x, layer->shown_y,
+			layer->zorder, layer->scale_x, layer->scale_y, layer->alpha);
+}
+
+/* called locked */
+static void window_layer_letterbox(struct window_layer *layer){
+	int32_t w = layer->box_width;
+	int32_t h = layer->box_height;
+	if((int64_t)layer->width * layer->box_height > (int64_t)layer->height * layer->box_width)
+		h = (int64_t)layer->height * layer->box_width / layer->width;
+	else
+		w = (int64_t)layer->width * layer->box_height / layer->height;
+	printf("window %dx%d shown as %dx%d in %dx%d box (resizes %d frames held %d)\n",
+		layer->width, layer->height, w, h, layer->box_width, layer->box_height,
+		layer->resizes, layer->held);
+	layer->shown_x = layer->opt->xpos + (layer->box_width - w) / 2;
+	layer->shown_y = layer->opt->ypos + (layer->box_height - h) / 2;
+	layer->scale_x = (double) w / layer->width;
+	layer->scale_y = (double) h / layer->height;
+	g_object_set(G_OBJECT(layer->mixpad),
+		"xpos", layer->shown_x, "ypos", layer->shown_y,
+		"width", w, "height", h, NULL);
+}
+
+/* A scene moves the window's box and the letterbox inside it follows. The
+ * pointer fades and restacks with the window on the same frame. */
+static void window_layer_place(gpointer data, const struct scene_state *state){
+	struct window_layer *layer = data;
+	g_mutex_lock(&layer->lock);
+	if(state->xpos != layer->opt->xpos || state->ypos != layer->opt->ypos){
+		layer->opt->xpos = state->xpos;
+		layer->opt->ypos = state->ypos;
+		if(layer->width > 0 && layer->box_width > 0){
+			window_layer_letterbox(layer);
+		} else {
+			g_object_set(G_OBJECT(layer->mixpad), "xpos", state->xpos, "ypos", state->ypos, NULL);
+			layer->shown_x = state->xpos;
+			layer->shown_y = state->ypos;
+		}
 	}
+	layer->alpha = state->alpha;
+	layer->zorder = state->zorder;
+	window_layer_cursor(layer);
+	g_mutex_unlock(&layer->lock);
+}
 
-	GstClock *clock;
-	GMainLoop *loop;
-	GstElement *pipeline;
-	GstElement *audiobin;
-	GstElement *audiotee;
-	GstElement *audio_rtp_queue;
-	GstElement *audio_rtmp_queue;
-	GstElement *audio_save_queue;
-	GstElement *videncbin;
-	GstElement *videnctee;
-	GstElement *video_rtp_queue;
-	GstElement *video_rtmp_queue;
-	GstElement *video_save_queue;
-	GstElement *h264enc;
-	GstElement *rtpbin;
-	GstElement *rtpsink;
-	GstElement *tsmux;
-	GstElement *flashmux;
-	GstElement *savemux;
-	GstElement *preenc;
-	GstElement *rtmpbin;
-	GstElement *savebin;
-	GstElement *savesink;
-	GstElement *streamsink;
-	GstElement *window_el, *vidqueue;
-	GstElement *audio_enc;
+GstPadProbeReturn window_resize_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct window_layer *layer = data;
+	GstPadProbeType type = GST_PAD_PROBE_INFO_TYPE(info);
+	GstPadProbeReturn ret = GST_PAD_PROBE_OK;
+
+	if(type & GST_PAD_PROBE_TYPE_BUFFER){
+		g_mutex_lock(&layer->lock);
+		if(layer->settle > 0){
+			layer->settle--;
+			layer->held++;
+			ret = GST_PAD_PROBE_DROP;
+		} else if(layer->pending){
+			window_layer_letterbox(layer);
+			window_layer_cursor(layer);
+			layer->pending = false;
+		}
+		g_mutex_unlock(&layer->lock);
+		return ret;
+	}
+
+	GstEvent *event = gst_pad_probe_info_get_event(info);
+	if(GST_EVENT_TYPE(event) != GST_EVENT_CAPS)
+		return GST_PAD_PROBE_OK;
+	GstCaps *caps;
+	gint width = 0, height = 0;
+	gst_event_parse_caps(event, &caps);
+	GstStructure *cap = gst_caps_get_structure(caps, 0);
+	if(!gst_structure_get_int(cap, "width", &width) || !gst_structure_get_int(cap, "height", &height)
+			|| width <= 0 || height <= 0)
+		return GST_PAD_PROBE_OK;
+	g_mutex_lock(&layer->lock);
+	if(width != layer->width || height != layer->height){
+		if(layer->box_width <= 0 || layer->box_height <= 0){
+			layer->box_width = width;
+			layer->box_height = height;
+		} else if(layer->width > 0){
+			layer->resizes++;
+			layer->settle = WINDOW_SETTLE_FRAMES;
+		}
+		layer->width = width;
+		layer->height = height;
+		layer->pending = true;
+	}
+	g_mutex_unlock(&layer->lock);
+	return GST_PAD_PROBE_OK;
+}
+
+static void window_layer_free(gpointer data){
+	struct window_layer *layer = data;
+	g_mutex_clear(&layer->lock);
+	g_free(layer);
+}
 
+/* Pin the mixer output to the first caps it negotiates */
+GstPadProbeReturn pin_caps_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	GstElement *mixpin = data;
+	GstEvent *event = gst_pad_probe_info_get_event(info);
+	if(GST_EVENT_TYPE(event) != GST_EVENT_CAPS)
+		return GST_PAD_PROBE_OK;
+	GstCaps *caps;
+	gst_event_parse_caps(event, &caps);
+	GstCaps *pinned = gst_caps_copy(caps);
+	gchar *caps_str = gst_caps_to_string(pinned);
+	printf("composite pinned to %s\n", caps_str);
+	g_free(caps_str);
+	g_object_set(G_OBJECT(mixpin), "caps", pinned, NULL);
+	gst_caps_unref(pinned);
+	return GST_PAD_PROBE_REMOVE;
+}
+
+/* the pointer goes above every layer, wherever a scene puts it */
+static unsigned int top_zorder(struct arguments *arrrgs){
+	unsigned int zorder = arrrgs->window.composite.zorder;
+	zorder = MAX(zorder, arrrgs->camera.composite.zorder);
+	zorder = MAX(zorder, arrrgs->image.composite.zorder);
+	for(int i = 0 ; i < arrrgs->regions ; i++)
+		zorder = MAX(zorder, arrrgs->region[i].composite.zorder);
+	for(int i = 0 ; i < arrrgs->medias ; i++)
+		zorder = MAX(zorder, arrrgs->media[i].composite.zorder);
+	for(int i = 0 ; i < arrrgs->scenes ; i++)
+		for(int j = 0 ; j < arrrgs->scene[i].places ; j++)
+			if(arrrgs->scene[i].place[j].zorder != SCENE_UNSET)
+				zorder = MAX(zorder, (unsigned int) arrrgs->scene[i].place[j].zorder);
+	return zorder;
+}
+
+void add_window_layer(GstElement *pipeline, GstElement *mix, struct arguments *arrrgs){
+	GstElement *window_el, *vidqueue;
 	GstCaps *framerate_caps;
-	GstCaps *resize_caps;
+	GstPad *winpad;
 
-	gst_init(NULL,NULL);
+	vidqueue = add_composite_pipeline(pipeline, mix, "window", &arrrgs->window.composite, &winpad);
+	window_el = gst_element_factory_make("ximagesrc", "window_el");
+	g_object_set(G_OBJECT(window_el),"use-damage", FALSE, NULL);
+	if(arrrgs->window.display[0] != '\0')
+		g_object_set(G_OBJECT(window_el),"display-name", arrrgs->window.display, NULL);
+	/* pointer is its own layer, see cursor.c */
+	g_object_set(G_OBJECT(window_el),"show-pointer", FALSE, NULL);
+	g_object_set(G_OBJECT(window_el),"xid", arrrgs->window.xid, NULL);
+	if(arrrgs->window.composite.use_crop){
+		g_object_set(G_OBJECT(window_el),
+			"startx", arrrgs->window.composite.left,
+			"starty", arrrgs->window.composite.top,
+			"endx", arrrgs->window.composite.right,
+			"endy", arrrgs->window.composite.bottom, NULL);
+	}
+	gst_bin_add(GST_BIN(pipeline), window_el);
 
-	/* audio pipeline */
-	switch(arrrgs.audio.format){
-		case AAC:
-			printf("case AAC\n");
-			audiobin = gst_parse_bin_from_description(
-			"pulsesrc ! queue ! audioconvert ! avenc_aac name=audio_enc ! aacparse "
-			"! audio/mpeg,mpegversion=4,stream-format=raw ! queue",
-			true, NULL);
-			break;
-		case MP3:
-			printf("case MP3\n");
-			audiobin = gst_parse_bin_from_description(
-			"pulsesrc ! queue ! audioconvert ! lamemp3enc name=audio_enc target=1 ! mpegaudioparse ! queue",
-			true, NULL);
-			break;
-		default:
-			printf("switch unknown audio format\n");
+	struct window_layer *winlayer = g_new0(struct window_layer, 1);
+	g_mutex_init(&winlayer->lock);
+	winlayer->opt = &arrrgs->window.composite;
+	winlayer->mixpad = winpad;
+	winlayer->shown_x = arrrgs->window.composite.xpos;
+	winlayer->shown_y = arrrgs->window.composite.ypos;
+	winlayer->scale_x = 1.0;
+	winlayer->scale_y = 1.0;
+	winlayer->alpha = arrrgs->window.composite.alpha;
+	winlayer->zorder = arrrgs->window.composite.zorder;
+	if(arrrgs->window.composite.use_scale){
+		winlayer->box_width = arrrgs->window.composite.scale_width;
+		winlayer->box_height = arrrgs->window.composite.scale_height;
 	}
+	GstPad *winsrc = gst_element_get_static_pad(window_el, "src");
+	gst_pad_add_probe(winsrc, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+		(GstPadProbeCallback) window_resize_probe, winlayer, window_layer_free);
 
-	audio_enc = gst_bin_get_by_name(GST_BIN(audiobin), "audio_enc");
-	g_object_set(G_OBJECT(audio_enc), "bitrate", arrrgs.audio_bitrate != 0 ? arrrgs.audio_bitrate : default_audio_bitrate, NULL);
-	if(arrrgs.audio_bitrate == 0)
-		arrrgs.audio_bitrate = default_audio_bitrate;
+	framerate_caps = gst_caps_new_simple("video/x-raw",
+					     "framerate", GST_TYPE_FRACTION, arrrgs->window.framerate, 1,
+					     NULL);
+	gst_element_link_filtered(window_el, vidqueue, framerate_caps);
 
-	/* video compress pipeline */
-	videncbin = gst_parse_bin_from_description(
-		"queue ! videoconvert ! queue ! vaapih264enc name=h264enc max-bframes=0 tune=3"
-		" ! queue ! h264parse config-interval=1 ! queue", true, NULL);
-		/* need to expose all of the compression tuning controls */
-	h264enc = gst_bin_get_by_name(GST_BIN(videncbin), "h264enc");
-	if(arrrgs.video_bitrate > 0){
-		g_object_set(G_OBJECT(h264enc), "bitrate", arrrgs.video_bitrate, NULL);
-	} else {
-		g_object_get(G_OBJECT(h264enc), "bitrate", &arrrgs.video_bitrate, NULL);
-		/* well crap I should have known this would not have a number before video starts */
-		/* I guess fix this when adding interactive features */
-		// FIXME
+	if(arrrgs->window.show_pointer){
+		/* starts unscaled, the letterbox places it once the window size is known */
+		struct cursor_area area = { 0 };
+		area.xid = arrrgs->window.xid;
+		area.use_crop = arrrgs->window.composite.use_crop;
+		area.left = arrrgs->window.composite.left;
+		area.top = arrrgs->window.composite.top;
+		area.right = arrrgs->window.composite.right;
+		area.bottom = arrrgs->window.composite.bottom;
+		area.xpos = arrrgs->window.composite.xpos;
+		area.ypos = arrrgs->window.composite.ypos;
+		winlayer->cursor = add_cursor_layer(pipeline, mix,
+			arrrgs->window.display[0] != '\0' ? arrrgs->window.display : NULL,
+			&area, top_zorder(arrrgs) + 1, arrrgs->window.framerate);
 	}
+	add_scene_layer("window", winpad, &arrrgs->window.composite, window_layer_place, winlayer);
+}
 
-	/* rtp pipeline */
-	rtpbin = gst_parse_bin_from_description(
-		"queue ! rtpmp2tpay ! udpsink name=rtpsink", true, NULL );
+/* Region layers share one screen grab. A single ximagesrc grabs the bounding
+ * box of all of them through XShm, it is uploaded once, and each region is
+ * cut out of that one texture by a shader, so more regions cost GPU passes
+ * instead of more X round trips and copies. */
+static const char *region_shader =
+	"#ifdef GL_ES\n"
+	"precision mediump float;\n"
+	"#endif\n"
+	"varying vec2 v_texcoord;\n"
+	"uniform sampler2D tex;\n"
+	"uniform float region_x;\n"
+	"uniform float region_y;\n"
+	"uniform float region_w;\n"
+	"uniform float region_h;\n"
+	"void main () {\n"
+	"  vec2 pos = vec2(region_x, region_y) + v_texcoord * vec2(region_w, region_h);\n"
+	"  gl_FragColor = texture2D(tex, pos);\n"
+	"}\n";
+
+static int ignore_x_error(Display *dpy, XErrorEvent *err){
+	printf("X error %d looking up region window\n", err->error_code);
+	return 0;
+}
 
-	/* rtmp pipeline */
-	rtmpbin = gst_parse_bin_from_description("queue leaky=downstream ! rtmpsink name=streamsink", true, NULL);
+/* Area of a window on screen, clipped to the screen. Only looked up at
+ * startup, moving the window later doesn't move the region. FIXME */
+static bool region_from_window(Display *dpy, struct region_options *region){
+	struct composite_options *opt = &region->composite;
+	XWindowAttributes attr;
+	Window child;
+	int x, y;
 
-	/* save pipeline */
-	savebin = gst_parse_bin_from_description("queue ! filesink name=savesink", true, NULL);
+	if(!XGetWindowAttributes(dpy, region->xid, &attr)){
+		printf("no window 0x%08x for region\n", region->xid);
+		return false;
+	}
+	XTranslateCoordinates(dpy, region->xid, attr.root, 0, 0, &x, &y, &child);
+	int screen_width = WidthOfScreen(attr.screen);
+	int screen_height = HeightOfScreen(attr.screen);
+	opt->left = CLAMP(x, 0, screen_width - 1);
+	opt->top = CLAMP(y, 0, screen_height - 1);
+	opt->right = CLAMP(x + attr.width - 1, 0, screen_width - 1);
+	opt->bottom = CLAMP(y + attr.height - 1, 0, screen_height - 1);
+	opt->use_crop = true;
+	return true;
+}
 
-	/* main pipeline */
-	pipeline = gst_parse_launch(
-		"glcolorconvert name=glcc ! gldownload ! queue ! tee name=vid_raw_tee ! queue ! gtksink "
-		"vid_raw_tee. ! queue name=preenc", NULL);
-	GstElement *glcc = gst_bin_get_by_name(GST_BIN(pipeline), "glcc");
+void add_screen_regions(GstElement *pipeline, GstElement *mix, struct arguments *arrrgs){
+	uint32_t left = UINT32_MAX, top = UINT32_MAX, right = 0, bottom = 0;
+	char *display = arrrgs->window.display[0] != '\0' ? arrrgs->window.display : NULL;
+	Display *dpy = XOpenDisplay(display);
+	int (*old_handler)(Display *, XErrorEvent *) = XSetErrorHandler(ignore_x_error);
+
+	for(int i = 0 ; i < arrrgs->regions ; i++){
+		struct region_options *region = &arrrgs->region[i];
+		struct composite_options *opt = &region->composite;
+		if(region->xid != 0 && dpy != NULL && !region_from_window(dpy, region))
+			opt->use_crop = false;
+		if(!opt->use_crop || opt->right < opt->left || opt->bottom < opt->top){
+			printf("region %d has no area, skipping\n", i);
+			opt->use_crop = false;
+			continue;
+		}
+		left = MIN(left, opt->left);
+		top = MIN(top, opt->top);
+		right = MAX(right, opt->right);
+		bottom = MAX(bottom, opt->bottom);
+	}
+	XSetErrorHandler(old_handler);
+	if(dpy != NULL)
+		XCloseDisplay(dpy);
+	if(right < left || bottom < top)
+		return;
+
+	double grab_width = right - left + 1;
+	double grab_height = bottom - top + 1;
+	printf("screen grab %d,%d to %d,%d for %d regions\n", left, top, right, bottom, arrrgs->regions);
+
+	GstElement *screen_el = gst_element_factory_make("ximagesrc", "screen_el");
+	g_object_set(G_OBJECT(screen_el), "use-damage", FALSE,
+		"show-pointer", arrrgs->window.show_pointer,
+		"startx", left, "starty", top, "endx", right, "endy", bottom, NULL);
+	if(display != NULL)
+		g_object_set(G_OBJECT(screen_el), "display-name", display, NULL);
+	GstElement *screenqueue = gst_element_factory_make("queue", NULL);
+	GstElement *screenup = gst_element_factory_make("glupload", NULL);
+	GstElement *screencvt = gst_element_factory_make("glcolorconvert", NULL);
+	GstElement *screentee = gst_element_factory_make("tee", "screentee");
+	gst_bin_add_many(GST_BIN(pipeline), screen_el, screenqueue, screenup, screencvt, screentee, NULL);
+	GstCaps *framerate_caps = gst_caps_new_simple("video/x-raw",
+		"framerate", GST_TYPE_FRACTION, arrrgs->window.framerate, 1, NULL);
+	gst_element_link_filtered(screen_el, screenqueue, framerate_caps);
+	gst_caps_unref(framerate_caps);
+	gst_element_link_many(screenqueue, screenup, screencvt, screentee, NULL);
+
+	for(int i = 0 ; i < arrrgs->regions ; i++){
+		struct composite_options *opt = &arrrgs->region[i].composite;
+		if(!opt->use_crop)
+			continue;
+		int32_t width = opt->right - opt->left + 1;
+		int32_t height = opt->bottom - opt->top + 1;
+		if(opt->use_scale){
+			width = opt->scale_width;
+			height = opt->scale_height;
+		}
+		GstElement *regionqueue = gst_element_factory_make("queue", NULL);
+		GstElement *shader = gst_element_factory_make("glshader", NULL);
+		GstStructure *uniforms = gst_structure_new("uniforms",
+			"region_x", G_TYPE_FLOAT, (opt->left - left) / grab_width,
+			"region_y", G_TYPE_FLOAT, (opt->top - top) / grab_height,
+			"region_w", G_TYPE_FLOAT, (opt->right - opt->left + 1) / grab_width,
+			"region_h", G_TYPE_FLOAT, (opt->bottom - opt->top + 1) / grab_height, NULL);
+		g_object_set(G_OBJECT(shader), "fragment", region_shader, "uniforms", uniforms, NULL);
+		gst_structure_free(uniforms);
+
+		GstCaps *region_caps = gst_caps_new_simple("video/x-raw",
+			"width", G_TYPE_INT, width, "height", G_TYPE_INT, height, NULL);
+		gst_caps_set_features(region_caps, 0, gst_caps_features_from_string("memory:GLMemory"));
+		GstElement *region_filter = gst_element_factory_make("capsfilter", NULL);
+		g_object_set(G_OBJECT(region_filter), "caps", region_caps, NULL);
+		gst_caps_unref(region_caps);
+
+		gst_bin_add_many(GST_BIN(pipeline), regionqueue, shader, region_filter, NULL);
+		gst_element_link_many(screentee, regionqueue, shader, region_filter, NULL);
+		GstElement *last_element = region_filter;
+		if(opt->effect > 0){
+			GstElement *effect = gst_element_factory_make("gleffects", NULL);
+			g_object_set(G_OBJECT(effect), "effect", opt->effect, NULL);
+			gst_bin_add(GST_BIN(pipeline), effect);
+			gst_element_link(last_element, effect);
+			last_element = effect;
+		}
+		gst_element_link(last_element, mix);
+		GstPad *regionsrc = gst_element_get_static_pad(last_element, "src");
+		GstPad *mixpad = gst_pad_get_peer(regionsrc);
+		g_object_set(G_OBJECT(mixpad), "xpos", opt->xpos, "ypos", opt->ypos, "zorder", opt->zorder,
+			"alpha", opt->alpha, NULL);
+		gchar *name = g_strdup_printf("region%d", i);
+		add_layer_stats(name, regionqueue, mixpad);
+		add_scene_layer(name, mixpad, opt, NULL, NULL);
+	}
+}
+
+/* Replaces screen grabbing a player window: the decoder feeds the layer
+ * directly, see media.c */
+void add_media_layer(GstElement *pipeline, GstElement *mix, int index, struct media_source_options *opt){
+	GstPad *mixpad;
+	gchar *name = g_strdup_printf("media%d", index);
+	GstElement *vidqueue = add_composite_pipeline(pipeline, mix, name, &opt->composite, &mixpad);
+	struct media_layer *media = media_layer_new(pipeline, name, &opt->media, vidqueue);
+	if(media == NULL)
+		return; // layer stays empty
+	media_layer_hold_last(media, mixpad);
+	media_layers[media_layer_count++] = media;
+}
+
+/* GL picks its window system from the environment when it makes its display,
+ * so this has to happen before gst_init. Surfaceless EGL needs no display
+ * server or drm device at all, which is what Mesa llvmpipe in a container
+ * has. Anything already set in the environment wins. X capture still uses
+ * the display option, ximagesrc has its own connection. */
+void setup_headless_gl(struct headless_options *opt){
+	g_setenv("GST_GL_PLATFORM", "egl", FALSE);
+	g_setenv("GST_GL_WINDOW", opt->gbm ? "gbm" : "surfaceless", FALSE);
+	if(opt->gbm && opt->device != NULL)
+		g_setenv("GST_GL_GBM_DRM_DEVICE", opt->device, FALSE);
+	printf("headless: GL on %s %s\n", g_getenv("GST_GL_PLATFORM"), g_getenv("GST_GL_WINDOW"));
+	// FIXME surfaceless needs GStreamer 1.24, older ones fall back to whatever they find
+}
+
+/* Full path: every layer goes through glupload, the mixer, and gldownload
+ * before the tee that feeds both the preview and the encoder. Headless
+ * there is nothing to tee to, so the download goes straight to the encoder. */
+GstElement * build_composite_pipeline(struct arguments *arrrgs, GstElement **preenc){
+	GstElement *pipeline;
+
+	pipeline = gst_pipeline_new(NULL);
+	GstElement *glcc = gst_element_factory_make("glcolorconvert", "glcc");
+	GstElement *download = gst_element_factory_make("gldownload", NULL);
+	*preenc = gst_element_factory_make("queue", "preenc");
+	gst_bin_add_many(GST_BIN(pipeline), glcc, download, *preenc, NULL);
+	if(arrrgs->use_headless){
+		gst_element_link_many(glcc, download, *preenc, NULL);
+	} else {
+		GstElement *rawqueue = gst_element_factory_make("queue", NULL);
+		GstElement *vid_raw_tee = gst_element_factory_make("tee", "vid_raw_tee");
+		GstElement *previewqueue = gst_element_factory_make("queue", NULL);
+		GstElement *preview = gst_element_factory_make("gtksink", NULL);
+		gst_bin_add_many(GST_BIN(pipeline), rawqueue, vid_raw_tee, previewqueue, preview, NULL);
+		gst_element_link_many(glcc, download, rawqueue, vid_raw_tee, previewqueue, preview, NULL);
+		gst_element_link(vid_raw_tee, *preenc);
+	}
 	GstElement *mix = gst_element_factory_make("glvideomixerelement", NULL);
+	if(arrrgs->scenes > 0)
+		scenes = scene_set_new(arrrgs->scene, arrrgs->scenes);
+	/* holds the composite at its first size, see window_resize_probe */
+	GstElement *mixpin = gst_element_factory_make("capsfilter", "mixpin");
 	GstPad *mixsrc = gst_element_get_static_pad(mix, "src");
-	gst_bin_add(GST_BIN(pipeline), mix);
+	GstPad *pinsrc = gst_element_get_static_pad(mixpin, "src");
+	gst_bin_add_many(GST_BIN(pipeline), mix, mixpin, NULL);
+	gst_element_link(mix, mixpin);
+	gst_pad_add_probe(mixsrc, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+		(GstPadProbeCallback) pin_caps_probe, mixpin, NULL);
+	gst_pad_add_probe(mixsrc, GST_PAD_PROBE_TYPE_BUFFER,
+		(GstPadProbeCallback) mixer_output_probe, NULL, NULL);
+	/* the GL thread never shows up on the bus */
+	thread_policy_add_gl(mix);
+	g_timeout_add_seconds(5, print_layer_stats, NULL);
 
-	if(arrrgs.output.framerate > 0 || arrrgs.output.composite.use_scale){
+	if(arrrgs->output.framerate > 0 || arrrgs->output.composite.use_scale){
 		GstElement *out_filter = gst_element_factory_make("capsfilter", NULL);
 		gst_bin_add(GST_BIN(pipeline), out_filter);
 		GstCaps *out_caps = gst_caps_new_empty();
 		GstStructure *out_caps_struct = gst_structure_new_empty("video/x-raw");
 		GstCapsFeatures * out_caps_feature = gst_caps_features_from_string("memory:GLMemory");
 
-		if(arrrgs.output.framerate > 0){
-			printf("set output framerate: %d\n", arrrgs.output.framerate);
+		if(arrrgs->output.framerate > 0){
+			printf("set output framerate: %d\n", arrrgs->output.framerate);
 			GValue rate = G_VALUE_INIT;
 			g_value_init(&rate, GST_TYPE_FRACTION);
-			gst_value_set_fraction(&rate, arrrgs.output.framerate, 1);
+			gst_value_set_fraction(&rate, arrrgs->output.framerate, 1);
 			gst_structure_set_value(out_caps_struct, "framerate", &rate);
 		}
-		if(arrrgs.output.composite.use_scale){
+		if(arrrgs->output.composite.use_scale){
 			printf("scalefilter\n");
-			gst_pad_add_probe(mixsrc, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
+			gst_pad_add_probe(pinsrc, GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
 				(GstPadProbeCallback) block_caps_probe, NULL, NULL);
 			GstElement *out_scale = gst_element_factory_make("glcolorscale", NULL);
 			GValue width = G_VALUE_INIT;
 			GValue height = G_VALUE_INIT;
 			g_value_init(&width, G_TYPE_INT);
 			g_value_init(&height, G_TYPE_INT);
-			g_value_set_int(&width, arrrgs.output.composite.scale_width);
-			g_value_set_int(&height, arrrgs.output.composite.scale_height);
+			g_value_set_int(&width, arrrgs->output.composite.scale_width);
+			g_value_set_int(&height, arrrgs->output.composite.scale_height);
 			gst_structure_set_value(out_caps_struct, "width", &width);
 			gst_structure_set_value(out_caps_struct, "height", &height);
 			gst_bin_add(GST_BIN(pipeline), out_scale);
-			gst_element_link_many(mix, out_scale, out_filter, glcc, NULL);
+			gst_element_link_many(mixpin, out_scale, out_filter, glcc, NULL);
 		} else {
-			gst_element_link_many(mix, out_filter, glcc, NULL);
+			gst_element_link_many(mixpin, out_filter, glcc, NULL);
 		}
 		gst_caps_append_structure_full(out_caps, out_caps_struct, out_caps_feature);
 		g_object_set(G_OBJECT(out_filter), "caps", out_caps, NULL);
 	} else {
-		gst_element_link(mix, glcc);
+		gst_element_link(mixpin, glcc);
 	}
 	// FIXME add glfilter
-	preenc = gst_bin_get_by_name(GST_BIN(pipeline), "preenc");
 	
 	// FIXME Should really only need one vidqueue
-	vidqueue = add_composite_pipeline(pipeline, mix, &arrrgs.window.composite);
-	GstElement *vidqueue2 = add_composite_pipeline(pipeline, mix, &arrrgs.camera.composite);
-	GstElement *vidqueue3 = add_composite_pipeline(pipeline, mix, &arrrgs.image.composite);
+	GstElement *vidqueue2 = add_composite_pipeline(pipeline, mix, "camera", &arrrgs->camera.composite, NULL);
+	GstElement *vidqueue3 = add_composite_pipeline(pipeline, mix, "image", &arrrgs->image.composite, NULL);
 
-	if(arrrgs.image.filename != NULL){
+	if(arrrgs->image.filename != NULL){
 		GstElement *image = gst_element_factory_make("filesrc", NULL);
-		printf("image location: %s\n", arrrgs.image.filename);
-		g_object_set(G_OBJECT(image), "location", arrrgs.image.filename, NULL);
+		printf("image location: %s\n", arrrgs->image.filename);
+		g_object_set(G_OBJECT(image), "location", arrrgs->image.filename, NULL);
 		//GstElement *image_dec = gst_element_factory_make("jpegdec", NULL);
 		GstElement *image_dec = gst_element_factory_make("decodebin", NULL);
 		GstElement *freeze = gst_element_factory_make("imagefreeze", NULL);
@@ -915,52 +2013,328 @@ int main(int argc, char *argv[])
 		gst_element_link_many(freeze, freeze_convert, vidqueue3, NULL);
 	}
 
-	if(arrrgs.camera.device != NULL){
-		GstElement *cam = gst_element_factory_make("v4l2src", NULL);
-		g_object_set(G_OBJECT(cam), "device",  arrrgs.camera.device , NULL);
-		gst_bin_add(GST_BIN(pipeline), cam);
+	if(arrrgs->camera.device != NULL){
+		GstElement *cam = add_camera_source(pipeline, &arrrgs->camera);
 		gst_element_link(cam, vidqueue2);
 	}
 
 	// FIXME make this work if not recording any windows
-	window_el = gst_element_factory_make("ximagesrc", "window_el");
-	g_object_set(G_OBJECT(window_el),"use-damage", FALSE, NULL);
-	if(arrrgs.window.display[0] != '\0')
-		g_object_set(G_OBJECT(window_el),"display-name", arrrgs.window.display, NULL);
-	g_object_set(G_OBJECT(window_el),"show-pointer", arrrgs.window.show_pointer, NULL);
-	g_object_set(G_OBJECT(window_el),"xid", arrrgs.window.xid, NULL);
-	if(arrrgs.window.composite.use_crop){
-		g_object_set(G_OBJECT(window_el),
-			"startx", arrrgs.window.composite.left,
-			"starty", arrrgs.window.composite.top,
-			"endx", arrrgs.window.composite.right,
-			"endy", arrrgs.window.composite.bottom, NULL);
+	if(arrrgs->use_window || arrrgs->regions == 0)
+		add_window_layer(pipeline, mix, arrrgs);
+	if(arrrgs->regions > 0)
+		add_screen_regions(pipeline, mix, arrrgs);
+	for(int i = 0 ; i < arrrgs->medias ; i++)
+		add_media_layer(pipeline, mix, i, &arrrgs->media[i]);
+	if(scenes != NULL)
+		scene_start(scenes, mixsrc);
+
+	return pipeline;
+}
+
+/* A lone camera that already outputs H.264 doesn't need the mixer or the
+ * encoder. Anything that needs raw frames (another layer, a region, a scene,
+ * the pointer, crop, scale, effects, moving or fading the camera) means
+ * taking the full compositing path instead. This is decided once at startup,
+ * layers can't be added to a running pipeline so nothing switches it back. */
+bool plan_passthrough(struct arguments *arrrgs){
+	struct composite_options *cam = &arrrgs->camera.composite;
+	if(!(arrrgs->use_rtp || arrrgs->use_rtmp || arrrgs->use_save || arrrgs->use_webrtc))
+		return false; // only the preview, which wants raw video
+	if(arrrgs->camera.device == NULL || arrrgs->camera.fourcc == NULL)
+		return false;
+	if(strcasecmp(arrrgs->camera.fourcc, "H264") != 0)
+		return false;
+	if(arrrgs->use_window || arrrgs->image.filename != NULL || arrrgs->medias > 0
+			|| arrrgs->regions > 0 || arrrgs->scenes > 0)
+		return false;
+	if(cam->use_crop || cam->use_scale || cam->effect > 0)
+		return false;
+	if(cam->xpos != 0 || cam->ypos != 0 || cam->alpha != 1.0)
+		return false;
+	if(arrrgs->output.composite.use_scale || arrrgs->output.composite.effect > 0)
+		return false;
+	return true;
+}
+
+/* Passthrough path: camera ! video/x-h264 ! h264parse ! queue, feeding videnctee.
+ * No preview since that would mean decoding again. */
+GstElement * build_passthrough_pipeline(struct arguments *arrrgs, GstElement **vidsrc){
+	GstElement *pipeline = gst_pipeline_new(NULL);
+	GstElement *cam = gst_element_factory_make("v4l2src", "passcam");
+	GstElement *cam_filter = gst_element_factory_make("capsfilter", NULL);
+	GstElement *parse = gst_element_factory_make("h264parse", NULL);
+	GstElement *passqueue = gst_element_factory_make("queue", "passqueue");
+	uint32_t framerate = arrrgs->camera.framerate > 0 ? arrrgs->camera.framerate : arrrgs->output.framerate;
+
+	g_object_set(G_OBJECT(cam), "device", arrrgs->camera.device, NULL);
+	g_object_set(G_OBJECT(parse), "config-interval", 1, NULL);
+
+	GstCaps *h264_caps = gst_caps_new_simple("video/x-h264",
+		"stream-format", G_TYPE_STRING, "byte-stream", NULL);
+	if(framerate > 0){
+		printf("passthrough framerate: %d\n", framerate);
+		gst_caps_set_simple(h264_caps, "framerate", GST_TYPE_FRACTION, framerate, 1, NULL);
 	}
-	gst_bin_add(GST_BIN(pipeline), window_el);
+	g_object_set(G_OBJECT(cam_filter), "caps", h264_caps, NULL);
+	gst_caps_unref(h264_caps);
 
-	framerate_caps = gst_caps_new_simple("video/x-raw",
-					     "framerate", GST_TYPE_FRACTION, arrrgs.window.framerate, 1,
-					     NULL);
-	gst_element_link_filtered(window_el, vidqueue, framerate_caps);
+	gst_bin_add_many(GST_BIN(pipeline), cam, cam_filter, parse, passqueue, NULL);
+	gst_element_link_many(cam, cam_filter, parse, passqueue, NULL);
+	*vidsrc = passqueue;
+	return pipeline;
+}
+
+/* watches the queues feeding a muxer */
+struct sync_monitor * add_sync_monitor(const char *name, GstElement *pipeline,
+		GstElement *audioqueue, GstElement *videoqueue){
+	GstPad *audiopad = gst_element_get_static_pad(audioqueue, "src");
+	GstPad *videopad = gst_element_get_static_pad(videoqueue, "src");
+	struct sync_monitor *monitor = sync_monitor_new(name, pipeline, audiopad, videopad);
+	gst_object_unref(audiopad);
+	gst_object_unref(videopad);
+	return monitor;
+}
+
+/* Linear bin from NULL terminated elements, with ghost pads on the ends.
+ * Same as gst_parse_bin_from_description without parsing a string. */
+GstElement * make_chain_bin(const char *name, GstElement *first, ...){
+	GstElement *bin = gst_bin_new(name);
+	GstElement *last = first;
+	GstElement *element;
+	va_list args;
+	gst_bin_add(GST_BIN(bin), first);
+	va_start(args, first);
+	while((element = va_arg(args, GstElement *)) != NULL){
+		gst_bin_add(GST_BIN(bin), element);
+		gst_element_link(last, element);
+		last = element;
+	}
+	va_end(args);
+	GstPad *sinkpad = gst_element_get_static_pad(first, "sink");
+	gst_element_add_pad(bin, gst_ghost_pad_new("sink", sinkpad));
+	gst_object_unref(sinkpad);
+	GstPad *srcpad = gst_element_get_static_pad(last, "src");
+	if(srcpad != NULL){
+		gst_element_add_pad(bin, gst_ghost_pad_new("src", srcpad));
+		gst_object_unref(srcpad);
+	}
+	return bin;
+}
+
+void watch_first_packet(GstElement *sink, const char *what){
+	GstPad *sinkpad = gst_element_get_static_pad(sink, "sink");
+	startup_watch_first(sinkpad, what);
+	gst_object_unref(sinkpad);
+}
+
+static gboolean quit_loop(gpointer data){
+	g_main_loop_quit((GMainLoop *)data);
+	return FALSE;
+}
+
+int main(int argc, char *argv[])
+{
+	startup_begin();
+	uint32_t default_audio_bitrate = 128000;
+	uint32_t default_rtp_port = 6970;
+	char doc[] = "I bet this program does something useful.";
+	char more_doc[] = "what does this do?";
+	struct arguments arrrgs = init_args();
+	struct argp argp_stuff = { options, argp_callback, more_doc, doc, 0, 0, 0};
+	/* getsubopt chops up argv, keep a clean copy to start the capture process with */
+	char **orig_argv = g_strdupv(argv);
+	argp_parse(&argp_stuff, argc, argv, 0, 0, &arrrgs);
+	startup_mark("options parsed");
+	printf("Parsed Options\n");
+	printf("xid: 0x%08x\n", arrrgs.window.xid);
+	printf("xname: %s\n", arrrgs.window.xname);
+	printf("display: %s\n", arrrgs.window.display);
+	printf("framerate: %d\n", arrrgs.window.framerate);
+	printf("pointer: %s\n", arrrgs.window.show_pointer ? "TRUE" : "FALSE");
+	printf("video_bitrate: %d\n", arrrgs.video_bitrate);
+	printf("audio_bitrate: %d\n", arrrgs.audio_bitrate);
+	printf("use_rtp: %s\n", arrrgs.use_rtp ? "TRUE" : "FALSE");
+	printf("rtp host: %s\n", arrrgs.rtp.host);
+	printf("rtp port: %d\n", arrrgs.rtp.port);
+	printf("use_rtmp: %s\n", arrrgs.use_rtmp ? "TRUE" : "FALSE");
+	printf("rtmp service: %s\n", rtmp_service_names[arrrgs.rtmp.service]);
+	printf("rtmp url: %s\n", arrrgs.rtmp.url);
+	printf("rtmp stream_key: %s\n", arrrgs.rtmp.key);
+	printf("window composite use crop: %s\n", arrrgs.window.composite.use_crop ? "TRUE" : "FALSE");
+	printf("window composite left: %d\n", arrrgs.window.composite.left);
+	printf("output scale_width: %d\n", arrrgs.output.composite.scale_width);
+	if(arrrgs.use_save){
+		printf("save filename: %s\n", arrrgs.save.filename);
+	}
+
+	GstClock *clock;
+	GMainLoop *loop;
+	GstElement *pipeline;
+	GstElement *audiotee;
+	GstElement *audio_rtp_queue;
+	GstElement *audio_rtmp_queue;
+	GstElement *audio_save_queue;
+	GstElement *videncbin = NULL;
+	GstElement *videnctee;
+	GstElement *video_rtp_queue;
+	GstElement *video_rtmp_queue;
+	GstElement *video_save_queue;
+	GstElement *h264enc;
+	GstElement *rtpbin = NULL;
+	GstElement *rtpsink;
+	GstElement *tsmux;
+	GstElement *savemux;
+	GstElement *preenc;
+	GstElement *savebin = NULL;
+	GstElement *savesink;
+	struct audio_frontend *audiofront = NULL;
+	struct webrtc_output *webrtc = NULL;
+	struct rtmp_output *rtmp = NULL;
+	struct sync_monitor *syncmon[3];
+	int syncmons = 0;
+
+	if(arrrgs.use_headless)
+		setup_headless_gl(&arrrgs.headless);
+	gst_init(NULL,NULL);
+	startup_mark("gst_init");
+	if(arrrgs.use_trace){
+		/* both halves of --split trace, each to its own file */
+		if(arrrgs.split.role == SPLIT_CAPTURE)
+			arrrgs.trace.filename = g_strdup_printf("%s.capture.json", arrrgs.trace.filename);
+		if(!trace_start(&arrrgs.trace))
+			arrrgs.use_trace = false;
+	}
+
+	/* two process mode, the encode half owns the shared memory */
+	struct shm_ring *ring = NULL;
+	char shm_name[64];
+	if(arrrgs.use_split){
+		if(arrrgs.split.name[0] == '\0'){
+			snprintf(shm_name, sizeof(shm_name), "bitcorder-%d", getpid());
+			arrrgs.split.name = shm_name;
+		}
+		if(arrrgs.split.role == SPLIT_CAPTURE){
+			printf("capture process, frames go to shared memory\n");
+			/* audio and outputs all belong to the encode half */
+			arrrgs.use_rtp = false;
+			arrrgs.use_rtmp = false;
+			arrrgs.use_save = false;
+			arrrgs.use_webrtc = false;
+			arrrgs.use_audio = false;
+			ring = shm_ring_attach(arrrgs.split.name);
+		} else {
+			ring = shm_ring_create(arrrgs.split.name, arrrgs.split.slots);
+		}
+		if(ring == NULL){
+			printf("could not set up shared memory %s\n", arrrgs.split.name);
+			return 1;
+		}
+	}
+	/* without the preview the composite has to go somewhere */
+	if(arrrgs.use_headless && arrrgs.split.role != SPLIT_CAPTURE
+			&& !(arrrgs.use_rtp || arrrgs.use_rtmp || arrrgs.use_save || arrrgs.use_webrtc)){
+		printf("headless needs --rtp, --rtmp, --save or --webrtc\n");
+		return 1;
+	}
+	bool passthrough = !arrrgs.use_split && plan_passthrough(&arrrgs);
+
+	if(arrrgs.audio_bitrate == 0)
+		arrrgs.audio_bitrate = default_audio_bitrate;
+
+	/* video compress pipeline, only when something is going to use it */
+	bool use_outputs = arrrgs.use_rtp || arrrgs.use_rtmp || arrrgs.use_save || arrrgs.use_webrtc;
+	if(!passthrough && arrrgs.split.role != SPLIT_CAPTURE && use_outputs){
+		h264enc = gst_element_factory_make("vaapih264enc", "h264enc");
+		g_object_set(G_OBJECT(h264enc), "max-bframes", 0, "tune", 3 /* low-power */, NULL);
+			/* need to expose all of the compression tuning controls */
+		GstElement *h264parse = gst_element_factory_make("h264parse", NULL);
+		g_object_set(G_OBJECT(h264parse), "config-interval", 1, NULL);
+		videncbin = make_chain_bin("videncbin",
+			gst_element_factory_make("queue", NULL),
+			gst_element_factory_make("videoconvert", NULL),
+			gst_element_factory_make("queue", NULL),
+			h264enc,
+			gst_element_factory_make("queue", NULL),
+			h264parse,
+			gst_element_factory_make("queue", NULL), NULL);
+		if(arrrgs.video_bitrate > 0){
+			g_object_set(G_OBJECT(h264enc), "bitrate", arrrgs.video_bitrate, NULL);
+		} else {
+			g_object_get(G_OBJECT(h264enc), "bitrate", &arrrgs.video_bitrate, NULL);
+			/* well crap I should have known this would not have a number before video starts */
+			/* I guess fix this when adding interactive features */
+			// FIXME
+		}
+	}
+
+	/* rtp pipeline */
+	if(arrrgs.use_rtp){
+		rtpbin = make_chain_bin("rtpbin",
+			gst_element_factory_make("queue", NULL),
+			gst_element_factory_make("rtpmp2tpay", NULL),
+			gst_element_factory_make("udpsink", "rtpsink"), NULL);
+	}
+
+	/* save pipeline */
+	if(arrrgs.use_save){
+		savebin = make_chain_bin("savebin",
+			gst_element_factory_make("queue", NULL),
+			gst_element_factory_make("filesink", "savesink"), NULL);
+	}
+
+	/* main pipeline */
+	if(passthrough){
+		printf("single H.264 camera, skipping compositing and encoding\n");
+		pipeline = build_passthrough_pipeline(&arrrgs, &preenc);
+	} else if(arrrgs.split.role == SPLIT_ENCODE){
+		printf("encode process, frames come from shared memory\n");
+		pipeline = gst_pipeline_new(NULL);
+		preenc = shm_ring_make_src(ring);
+		gst_bin_add(GST_BIN(pipeline), preenc);
+	} else {
+		pipeline = build_composite_pipeline(&arrrgs, &preenc);
+		if(arrrgs.split.role == SPLIT_CAPTURE){
+			/* NV12 is what the encoder wants, and it is 3/8 the size of RGBA */
+			GstElement *shmconvert = gst_element_factory_make("videoconvert", NULL);
+			GstElement *shmsink = shm_ring_make_sink(ring);
+			GstCaps *shm_caps = gst_caps_new_simple("video/x-raw",
+				"format", G_TYPE_STRING, "NV12", NULL);
+			gst_bin_add_many(GST_BIN(pipeline), shmconvert, shmsink, NULL);
+			gst_element_link(preenc, shmconvert);
+			gst_element_link_filtered(shmconvert, shmsink, shm_caps);
+			gst_caps_unref(shm_caps);
+		}
+	}
 
 	/* add audio to pipeline */
 	if(arrrgs.use_audio){
-		audiotee = gst_element_factory_make("tee", "audiotee");
-		gst_bin_add_many(GST_BIN(pipeline), audiobin, audiotee, NULL);
-		gst_element_link(audiobin, audiotee);
+		if(arrrgs.audio.inputs == 0){
+			arrrgs.audio.input[0].source = AUDIO_PULSE;
+			arrrgs.audio.input[0].device = NULL;
+			arrrgs.audio.input[0].gain = 1.0;
+			arrrgs.audio.inputs = 1;
+		}
+		audiofront = audio_frontend_new(pipeline, arrrgs.audio.input, arrrgs.audio.inputs,
+			arrrgs.audio.buffer_time, arrrgs.audio.latency_time);
 	}
 
 	/* add video encoder to pipeline */
-	if(arrrgs.use_rtp || arrrgs.use_rtmp || arrrgs.use_save){
+	if(use_outputs){
 		videnctee = gst_element_factory_make("tee", "videnctee");
-		gst_bin_add_many(GST_BIN(pipeline), videncbin, videnctee, NULL);
-		gst_element_link(preenc, videncbin);
-		gst_element_link(videncbin,videnctee);
+		if(passthrough){
+			gst_bin_add(GST_BIN(pipeline), videnctee);
+			gst_element_link(preenc, videnctee);
+		} else {
+			gst_bin_add_many(GST_BIN(pipeline), videncbin, videnctee, NULL);
+			gst_element_link(preenc, videncbin);
+			gst_element_link(videncbin,videnctee);
+		}
 	}
 
 	/* add rtp to pipeline */
 	if(arrrgs.use_rtp){
 		rtpsink = gst_bin_get_by_name(GST_BIN(rtpbin),"rtpsink");
+		watch_first_packet(rtpsink, "first rtp packet");
 		g_object_set(G_OBJECT(rtpsink), "host", arrrgs.rtp.host, NULL);
 		g_object_set(G_OBJECT(rtpsink), "port", arrrgs.rtp.port, NULL);
 		tsmux = gst_element_factory_make("mpegtsmux", "tsmux");
@@ -970,11 +2344,19 @@ int main(int argc, char *argv[])
 		gst_element_link(video_rtp_queue, tsmux);
 		gst_element_link(tsmux, rtpbin);
 
-		/* link audio */
+		/* link audio, MPEG-TS has no FLAC */
+		enum audio_format rtp_format = arrrgs.rtp.audio_format != INVALID_FORMAT ?
+			arrrgs.rtp.audio_format : arrrgs.audio.format;
+		if(rtp_format == FLAC){
+			printf("rtp can't carry flac, using aac\n");
+			rtp_format = AAC;
+		}
+		audiotee = audio_frontend_encoded(audiofront, pipeline, rtp_format, arrrgs.audio_bitrate);
 		audio_rtp_queue = gst_element_factory_make("queue", "audio_rtp_queue");
 		gst_bin_add(GST_BIN(pipeline), audio_rtp_queue);
 		gst_element_link(audiotee, audio_rtp_queue);
 		gst_element_link(audio_rtp_queue, tsmux);
+		syncmon[syncmons++] = add_sync_monitor("tsmux", pipeline, audio_rtp_queue, video_rtp_queue);
 	}
 
 	/* rtmp AKA YouTube/Twitch */
@@ -1019,37 +2401,38 @@ int main(int argc, char *argv[])
 
 		printf("rtmp_sink_location: %s\n", rtmp_sink_location);
 
-		// set sink properties
-		streamsink = gst_bin_get_by_name(GST_BIN(rtmpbin), "streamsink");
-		g_object_set(G_OBJECT(streamsink), "location", rtmp_sink_location, NULL);
-		// add mux flvmux streamable=true
-		// flashmux
-		flashmux = gst_element_factory_make("flvmux", "flashmux");
-		g_object_set(G_OBJECT(flashmux), "streamable", true, NULL);
 		// add queues
 		// audio_rtmp_queue
 		audio_rtmp_queue = gst_element_factory_make("queue", "audio_rtmp_queue");
 		// vidio_rtmp_queue
 		video_rtmp_queue = gst_element_factory_make("queue", "video_rtmp_queue");
-		// add rtmp bin
-		gst_bin_add_many(GST_BIN(pipeline), audio_rtmp_queue, video_rtmp_queue, flashmux, rtmpbin, NULL);
+		gst_bin_add_many(GST_BIN(pipeline), audio_rtmp_queue, video_rtmp_queue, NULL);
 		// link
 		
-		// link audio
+		// link audio, flv only has aac and mp3
+		enum audio_format rtmp_format = arrrgs.rtmp.audio_format != INVALID_FORMAT ?
+			arrrgs.rtmp.audio_format : arrrgs.audio.format;
+		if(rtmp_format != AAC && rtmp_format != MP3){
+			printf("rtmp can't carry %s, using aac\n", audio_format_names[rtmp_format]);
+			rtmp_format = AAC;
+		}
+		audiotee = audio_frontend_encoded(audiofront, pipeline, rtmp_format, arrrgs.audio_bitrate);
 		gst_element_link(audiotee, audio_rtmp_queue);
-		gst_element_link(audio_rtmp_queue, flashmux);
 
 		// link video
 		gst_element_link(videnctee, video_rtmp_queue);
-		gst_element_link(video_rtmp_queue, flashmux);
 
-		// link mux to stream
-		gst_element_link(flashmux, rtmpbin);
+		/* flvmux and rtmpsink are in their own pipeline so a dropped
+		 * connection can't stop the encoder, see rtmp.c */
+		rtmp = rtmp_output_new(pipeline, video_rtmp_queue, audio_rtmp_queue,
+			rtmp_sink_location, arrrgs.rtmp.backlog_ms);
+		syncmon[syncmons++] = add_sync_monitor("flashmux", pipeline, audio_rtmp_queue, video_rtmp_queue);
 
 	}
 	/* add save to pipeline */
 	if(arrrgs.use_save){
 		savesink = gst_bin_get_by_name(GST_BIN(savebin),"savesink");
+		watch_first_packet(savesink, "first saved packet");
 		g_object_set(G_OBJECT(savesink), "location", arrrgs.save.filename, NULL);
 		savemux = gst_element_factory_make("matroskamux", "savemux");
 		video_save_queue = gst_element_factory_make("queue", "video_save_queue");
@@ -1059,24 +2442,103 @@ int main(int argc, char *argv[])
 		gst_element_link(savemux, savebin);
 
 		/* link audio */
+		enum audio_format save_format = arrrgs.save.audio_format != INVALID_FORMAT ?
+			arrrgs.save.audio_format : arrrgs.audio.format;
+		audiotee = audio_frontend_encoded(audiofront, pipeline, save_format, arrrgs.audio_bitrate);
 		audio_save_queue = gst_element_factory_make("queue", "audio_save_queue");
 		gst_bin_add(GST_BIN(pipeline), audio_save_queue);
 		gst_element_link(audiotee, audio_save_queue);
 		gst_element_link(audio_save_queue, savemux);
+		syncmon[syncmons++] = add_sync_monitor("savemux", pipeline, audio_save_queue, video_save_queue);
+	}
+
+	/* add webrtc to pipeline, audio when there is any is always opus since that is what browsers take */
+	if(arrrgs.use_webrtc){
+		GstElement *opustee = audiofront != NULL ?
+			audio_frontend_encoded(audiofront, pipeline, OPUS, arrrgs.audio_bitrate) : NULL;
+		webrtc = webrtc_output_new(pipeline, videnctee, opustee, &arrrgs.webrtc);
+	}
+
+	/* one correction for every output, driven by the first muxer */
+	if(syncmons > 0 && arrrgs.sync.correct){
+		GstPad *encsink = gst_element_get_static_pad(videnctee, "sink");
+		sync_monitor_correct(syncmon[0], encsink, arrrgs.sync.slew);
+		gst_object_unref(encsink);
 	}
 
 
 	loop = g_main_loop_new(NULL, FALSE);
 
+	/* streaming threads start on the way to PAUSED */
+	thread_policy_install(pipeline, arrrgs.threads);
+	if(rtmp != NULL)
+		thread_policy_add_pipeline(rtmp_output_pipeline(rtmp));
+	memory_budget_install(pipeline, &arrrgs.memory);
+	if(rtmp != NULL)
+		memory_budget_add_pipeline(rtmp_output_pipeline(rtmp));
+
 	/* use system clock for timestamps instead of random start clock */
 	clock = gst_system_clock_obtain ();
 	g_object_set(G_OBJECT(clock), "clock-type", GST_CLOCK_TYPE_REALTIME, NULL);
 
+	/* the first frame, composited or straight from the camera or the
+	 * capture process, is on its way to the encoder here */
+	GstPad *preencsrc = gst_element_get_static_pad(preenc, "src");
+	startup_watch_first(preencsrc, passthrough ? "first camera frame" :
+		arrrgs.split.role == SPLIT_ENCODE ? "first frame from capture process" : "first composited frame");
+	gst_object_unref(preencsrc);
+	startup_mark("pipeline built");
+	GstElement *parallel[] = { videncbin, rtpbin, savebin };
+	startup_ready_parallel(pipeline, parallel, 3);
+
 	gst_element_set_state(pipeline, GST_STATE_PAUSED);
 	gst_element_set_state(pipeline, GST_STATE_PLAYING);
+	startup_mark("playing");
+
+	if(audiofront != NULL)
+		g_timeout_add_seconds(5, audio_frontend_print_stats, audiofront);
+	for(int i = 0 ; i < syncmons ; i++)
+		g_timeout_add_seconds(5, sync_monitor_print_stats, syncmon[i]);
+	thread_print_stats(NULL);
+	g_timeout_add_seconds(5, memory_print_stats, NULL);
+	if(scenes != NULL)
+		g_timeout_add_seconds(5, scene_print_stats, scenes);
+	if(webrtc != NULL)
+		g_timeout_add_seconds(5, webrtc_print_stats, webrtc);
+	if(rtmp != NULL)
+		g_timeout_add_seconds(5, rtmp_output_print_stats, rtmp);
+	for(int i = 0 ; i < media_layer_count ; i++)
+		g_timeout_add_seconds(5, media_print_stats, media_layers[i]);
+	g_timeout_add_seconds(5, thread_print_stats, NULL);
+	if(ring != NULL)
+		g_timeout_add_seconds(5, shm_ring_print_stats, ring);
+	/* shared memory and the trace file need to be cleaned up */
+	if(ring != NULL || arrrgs.use_trace){
+		g_unix_signal_add(SIGINT, quit_loop, loop);
+		g_unix_signal_add(SIGTERM, quit_loop, loop);
+	}
+	if(arrrgs.split.role == SPLIT_ENCODE){
+		/* same command line, later options win so this makes it the capture half */
+		guint orig_len = g_strv_length(orig_argv);
+		char **capture_argv = g_new0(char *, orig_len + 2);
+		memcpy(capture_argv, orig_argv, orig_len * sizeof(char *));
+		capture_argv[orig_len] = g_strdup_printf("--split=role=capture,name=%s", arrrgs.split.name);
+		shm_ring_spawn_capture(ring, capture_argv);
+		g_free(capture_argv[orig_len]);
+		g_free(capture_argv);
+	}
+
 	g_main_loop_run(loop);
+	if(arrrgs.use_trace)
+		trace_stop();
+	if(arrrgs.split.role == SPLIT_ENCODE)
+		shm_ring_stop_capture(ring);
+	if(rtmp != NULL)
+		gst_element_set_state(rtmp_output_pipeline(rtmp), GST_STATE_NULL);
 	gst_element_set_state(pipeline, GST_STATE_NULL);
 	gst_object_unref(pipeline);
+	shm_ring_destroy(ring);
+	g_strfreev(orig_argv);
 	return 0;
 }
 
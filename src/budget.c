@@ -0,0 +1,344 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include "budget.h"
+
+#define MAX_QUEUES 128
+#define MAX_BRANCHES 16
+#define MEMORY_KEEP "bitcorder-memory-keep"
+
+/* Levels are counted by the probes on the way in and out, the queue's own
+ * properties take its lock and would be read for every buffer. */
+struct memory_queue {
+	GstElement *queue;	// NULL when the slot is free
+	int branch;		// -1 until the caps say what it carries
+	bool fixed;		// layer queues and memory_budget_keep ones keep their limits
+	bool raw_video;
+	gint buffers;		// in the queue now, atomic
+	gint64 bytes;		// atomic
+	gint64 peak;
+	uint64_t dropped;	// raw frames leaked, only the queue's streaming thread writes it
+};
+
+static struct memory_options memory_opt;
+static uint64_t memory_budget;		// bytes for all queues together
+static gint64 memory_current;		// bytes in all queues, atomic
+static struct memory_queue memory_queues[MAX_QUEUES];
+static int memory_queue_count = 0;	// slots ever used
+static char memory_branches[MAX_BRANCHES][32];
+static int memory_branch_count = 0;
+static GMutex memory_lock;
+
+static int memory_branch(const char *name){
+	int branch;
+	g_mutex_lock(&memory_lock);
+	for(branch = 0 ; branch < memory_branch_count ; branch++)
+		if(strcmp(memory_branches[branch], name) == 0)
+			break;
+	if(branch == memory_branch_count){
+		if(memory_branch_count < MAX_BRANCHES)
+			snprintf(memory_branches[memory_branch_count++], 32, "%s", name);
+		else
+			branch = MAX_BRANCHES - 1;
+	}
+	g_mutex_unlock(&memory_lock);
+	return branch;
+}
+
+/* named bins and queues say which output they are part of, the rest go by
+ * what they carry. Caps arrive on many streaming threads, so the name goes
+ * in the caller's buffer. */
+static const char * memory_branch_name(GstElement *queue, const gchar *media, char *name, size_t len){
+	GstObject *parent = gst_object_get_parent(GST_OBJECT(queue));
+	name[0] = '\0';
+	if(parent != NULL){
+		if(GST_IS_BIN(parent) && !GST_IS_PIPELINE(parent)){
+			gchar *parent_name = gst_object_get_name(parent);
+			snprintf(name, len, "%s", parent_name);
+			g_free(parent_name);
+		}
+		gst_object_unref(parent);
+	}
+	if(name[0] != '\0')
+		return name;
+	gchar *queue_name = gst_object_get_name(GST_OBJECT(queue));
+	const char *branch;
+	if(strstr(queue_name, "rtmp") != NULL)
+		branch = "rtmp";
+	else if(strstr(queue_name, "rtp") != NULL)
+		branch = "rtp";
+	else if(strstr(queue_name, "save") != NULL)
+		branch = "save";
+	else if(g_str_has_prefix(media, "video/x-raw"))
+		branch = "composite";
+	else if(g_str_has_prefix(media, "audio/"))
+		branch = "audio";
+	else
+		branch = "video";
+	g_free(queue_name);
+	return branch;
+}
+
+/* Raw video queues come before the encoder, losing a frame there is a
+ * skipped frame, so they hold a few and leak. Everything after an encoder
+ * or a muxer only ever blocks, each branch on its own limits, so a stalled
+ * output stops itself and corrupts nobody else's stream. */
+static void memory_size_queue(struct memory_queue *mq, GstCaps *caps){
+	const gchar *media = gst_structure_get_name(gst_caps_get_structure(caps, 0));
+	char name[32];
+	gint leaky;
+	guint buffers;
+	g_object_get(G_OBJECT(mq->queue), "leaky", &leaky, "max-size-buffers", &buffers, NULL);
+	mq->fixed = (leaky != 0 && buffers == 1) || g_object_get_data(G_OBJECT(mq->queue), MEMORY_KEEP) != NULL;
+	mq->raw_video = g_str_has_prefix(media, "video/x-raw");
+	mq->branch = memory_branch(memory_branch_name(mq->queue, media, name, sizeof(name)));
+	if(mq->fixed)
+		return;
+	/* a frame can be bigger than the default bytes, the probe counts frames
+	 * and leaks before the queue would block */
+	if(mq->raw_video){
+		g_object_set(G_OBJECT(mq->queue), "max-size-buffers", memory_opt.frames + 1,
+			"max-size-time", (guint64) 0, "max-size-bytes", 0, NULL);
+	} else {
+		g_object_set(G_OBJECT(mq->queue), "max-size-buffers", 0,
+			"max-size-time", (guint64) memory_opt.encoded_ms * GST_MSECOND,
+			"max-size-bytes", (guint) MIN(MEMORY_QUEUE_BYTES, memory_budget), NULL);
+	}
+}
+
+/* Pools with no maximum grow while a stalled branch keeps taking buffers.
+ * Enough for whoever asked, our queue and one in flight. */
+static void memory_bound_pools(GstQuery *query){
+	guint pools = gst_query_get_n_allocation_pools(query);
+	for(guint i = 0 ; i < pools ; i++){
+		GstBufferPool *pool;
+		guint size, min, max;
+		gst_query_parse_nth_allocation_pool(query, i, &pool, &size, &min, &max);
+		guint limit = min + memory_opt.frames + 1;
+		if(max == 0 || max > limit)
+			gst_query_set_nth_allocation_pool(query, i, pool, size, min, limit);
+		if(pool != NULL)
+			gst_object_unref(pool);
+	}
+}
+
+static void memory_count(struct memory_queue *mq, gint buffers, gint64 bytes){
+	g_atomic_int_add(&mq->buffers, buffers);
+	gint64 level = __atomic_add_fetch(&mq->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&memory_current, bytes, __ATOMIC_RELAXED);
+	if(level > mq->peak)
+		mq->peak = level;
+}
+
+/* a flush empties the queue without anything going out the other side */
+static void memory_empty(struct memory_queue *mq){
+	g_atomic_int_set(&mq->buffers, 0);
+	gint64 bytes = __atomic_exchange_n(&mq->bytes, 0, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&memory_current, bytes, __ATOMIC_RELAXED);
+}
+
+static GstPadProbeReturn memory_queue_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct memory_queue *mq = data;
+
+	if(info->type & (GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST)){
+		gint buffers = 1;
+		gint64 size;
+		if(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST){
+			GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+			buffers = gst_buffer_list_length(list);
+			size = gst_buffer_list_calculate_size(list);
+		} else {
+			size = gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+		}
+		if(mq->raw_video && !mq->fixed
+				&& (g_atomic_int_get(&mq->buffers) >= (gint) memory_opt.frames
+				|| (uint64_t) __atomic_load_n(&memory_current, __ATOMIC_RELAXED) + size > memory_budget)){
+			mq->dropped++;
+			return GST_PAD_PROBE_DROP;
+		}
+		memory_count(mq, buffers, size);
+	} else if(info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM){
+		GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+		if(GST_EVENT_TYPE(event) == GST_EVENT_CAPS){
+			GstCaps *caps;
+			gst_event_parse_caps(event, &caps);
+			memory_size_queue(mq, caps);
+		} else if(GST_EVENT_TYPE(event) == GST_EVENT_FLUSH_STOP){
+			memory_empty(mq);
+		}
+	} else if((info->type & GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM) && (info->type & GST_PAD_PROBE_TYPE_PULL)){
+		/* the answer on its way back upstream */
+		GstQuery *query = GST_PAD_PROBE_INFO_QUERY(info);
+		if(GST_QUERY_TYPE(query) == GST_QUERY_ALLOCATION && mq->raw_video)
+			memory_bound_pools(query);
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn memory_queue_out_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct memory_queue *mq = data;
+	if(info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST){
+		GstBufferList *list = GST_PAD_PROBE_INFO_BUFFER_LIST(info);
+		memory_count(mq, -(gint) gst_buffer_list_length(list), -(gint64) gst_buffer_list_calculate_size(list));
+	} else {
+		memory_count(mq, -1, -(gint64) gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info)));
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+static void memory_add_queue(GstElement *element){
+	struct memory_queue *mq = NULL;
+	g_mutex_lock(&memory_lock);
+	for(int i = 0 ; i < memory_queue_count ; i++){
+		if(memory_queues[i].queue == element){
+			g_mutex_unlock(&memory_lock);
+			return; // element-added and deep-element-added both saw it
+		}
+		if(memory_queues[i].queue == NULL && mq == NULL)
+			mq = &memory_queues[i];
+	}
+	if(mq == NULL && memory_queue_count < MAX_QUEUES)
+		mq = &memory_queues[memory_queue_count++];
+	if(mq == NULL){
+		g_mutex_unlock(&memory_lock);
+		printf("memory budget: more than %d queues, %s is not counted\n", MAX_QUEUES, GST_OBJECT_NAME(element));
+		return;
+	}
+	memset(mq, 0, sizeof(*mq));
+	mq->queue = element;
+	mq->branch = -1;
+	g_mutex_unlock(&memory_lock);
+
+	GstPad *sink = gst_element_get_static_pad(element, "sink");
+	gst_pad_add_probe(sink, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST
+		| GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM | GST_PAD_PROBE_TYPE_EVENT_FLUSH
+		| GST_PAD_PROBE_TYPE_QUERY_DOWNSTREAM,
+		(GstPadProbeCallback) memory_queue_probe, mq, NULL);
+	gst_object_unref(sink);
+	GstPad *src = gst_element_get_static_pad(element, "src");
+	gst_pad_add_probe(src, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+		(GstPadProbeCallback) memory_queue_out_probe, mq, NULL);
+	gst_object_unref(src);
+}
+
+static bool memory_is_queue(GstElement *element){
+	GstElementFactory *factory = gst_element_get_factory(element);
+	return factory != NULL && strcmp(gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory)), "queue") == 0;
+}
+
+/* a bin that arrives already filled brings its queues with it */
+static void memory_add_element(GstElement *element){
+	if(!GST_IS_BIN(element)){
+		if(memory_is_queue(element))
+			memory_add_queue(element);
+		return;
+	}
+	GstIterator *it = gst_bin_iterate_recurse(GST_BIN(element));
+	GValue item = G_VALUE_INIT;
+	while(gst_iterator_next(it, &item) == GST_ITERATOR_OK){
+		GstElement *child = g_value_get_object(&item);
+		if(memory_is_queue(child))
+			memory_add_queue(child);
+		g_value_reset(&item);
+	}
+	g_value_unset(&item);
+	gst_iterator_free(it);
+}
+
+static void memory_remove_element(GstElement *element){
+	g_mutex_lock(&memory_lock);
+	for(int i = 0 ; i < memory_queue_count ; i++){
+		struct memory_queue *mq = &memory_queues[i];
+		if(mq->queue == NULL)
+			continue;
+		if(mq->queue == element || (GST_IS_BIN(element) && gst_object_has_as_ancestor(GST_OBJECT(mq->queue), GST_OBJECT(element)))){
+			memory_empty(mq);
+			mq->queue = NULL;
+		}
+	}
+	g_mutex_unlock(&memory_lock);
+}
+
+static void memory_element_added(GstBin *bin, GstElement *element, gpointer data){
+	memory_add_element(element);
+}
+
+static void memory_deep_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer data){
+	memory_add_element(element);
+}
+
+static void memory_element_removed(GstBin *bin, GstElement *element, gpointer data){
+	memory_remove_element(element);
+}
+
+static void memory_deep_element_removed(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer data){
+	memory_remove_element(element);
+}
+
+void memory_budget_keep(GstElement *queue){
+	g_object_set_data(G_OBJECT(queue), MEMORY_KEEP, GINT_TO_POINTER(1));
+}
+
+void memory_budget_add_pipeline(GstElement *pipeline){
+	/* webrtc viewers come and go, their queues with them */
+	g_signal_connect(pipeline, "element-added", G_CALLBACK(memory_element_added), NULL);
+	g_signal_connect(pipeline, "deep-element-added", G_CALLBACK(memory_deep_element_added), NULL);
+	g_signal_connect(pipeline, "element-removed", G_CALLBACK(memory_element_removed), NULL);
+	g_signal_connect(pipeline, "deep-element-removed", G_CALLBACK(memory_deep_element_removed), NULL);
+	memory_add_element(pipeline);
+}
+
+void memory_budget_install(GstElement *pipeline, struct memory_options *opt){
+	memory_opt = *opt;
+	if(memory_opt.frames == 0)
+		memory_opt.frames = MEMORY_DEFAULT_FRAMES;
+	if(memory_opt.encoded_ms == 0)
+		memory_opt.encoded_ms = MEMORY_DEFAULT_ENCODED_MS;
+	if(memory_opt.budget == 0)
+		memory_opt.budget = MEMORY_DEFAULT_BUDGET;
+	memory_budget = (uint64_t) memory_opt.budget * 1024 * 1024;
+	g_mutex_init(&memory_lock);
+	memory_budget_add_pipeline(pipeline);
+	printf("memory budget %u MB for raw video, %d queues so far, %u raw frames, %u ms encoded\n",
+		memory_opt.budget, memory_queue_count, memory_opt.frames, memory_opt.encoded_ms);
+}
+
+gboolean memory_print_stats(gpointer data){
+	uint64_t current[MAX_BRANCHES] = { 0 };
+	uint64_t peak[MAX_BRANCHES] = { 0 };
+	uint64_t dropped[MAX_BRANCHES] = { 0 };
+	g_mutex_lock(&memory_lock);
+	for(int i = 0 ; i < memory_queue_count ; i++){
+		struct memory_queue *mq = &memory_queues[i];
+		if(mq->queue == NULL || mq->branch < 0)
+			continue;
+		current[mq->branch] += __atomic_load_n(&mq->bytes, __ATOMIC_RELAXED);
+		peak[mq->branch] += mq->peak;
+		dropped[mq->branch] += mq->dropped;
+	}
+	int branches = memory_branch_count;
+	g_mutex_unlock(&memory_lock);
+	/* peak adds up each queue's own worst, they may not have happened together */
+	for(int branch = 0 ; branch < branches ; branch++)
+		printf("memory %s: %lu KB peak %lu KB raw frames leaked %lu\n", memory_branches[branch],
+			(unsigned long) (current[branch] / 1024), (unsigned long) (peak[branch] / 1024),
+			(unsigned long) dropped[branch]);
+	return TRUE;
+}
@@ -0,0 +1,58 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITCORDER_BUDGET_H
+#define BITCORDER_BUDGET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gst/gst.h>
+
+/* Memory budget for the queues. The queue defaults are 200 buffers, 10MB
+ * or 1 second, and 10MB is about one raw 1440p frame. Raw video queues are
+ * limited by frame count instead, and leak new frames when they are full or
+ * when all queues together hold the budget in bytes. Everything else, which
+ * is after an encoder or a muxer, keeps the time limit and never gets more
+ * than the default bytes, and only ever blocks its own branch. Buffer pools
+ * behind raw video queues get a maximum so a stalled output stops the
+ * producer instead of growing. Queues added later, like webrtc viewers, are
+ * picked up as they are added. */
+
+#define MEMORY_DEFAULT_BUDGET 1024		// MB for all queues together
+#define MEMORY_DEFAULT_FRAMES 3
+#define MEMORY_DEFAULT_ENCODED_MS 1000
+#define MEMORY_QUEUE_BYTES (10 * 1024 * 1024)	// queue's own default
+
+struct memory_options {
+	uint32_t budget;	// MB
+	uint32_t frames;	// raw video queues
+	uint32_t encoded_ms;	// every other queue
+};
+
+/* finds every queue in pipeline and watches for new ones */
+void memory_budget_install(GstElement *pipeline, struct memory_options *opt);
+/* same for another pipeline, after install */
+void memory_budget_add_pipeline(GstElement *pipeline);
+/* a queue whose limits were set on purpose, counted but left alone, any
+ * time before its caps arrive */
+void memory_budget_keep(GstElement *queue);
+
+/* g_timeout_add callback, prints current and peak bytes per branch, and
+ * what was dropped for the budget */
+gboolean memory_print_stats(gpointer data);
+
+#endif
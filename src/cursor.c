@@ -0,0 +1,252 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xfixes.h>
+#include "cursor.h"
+
+/* Cursor images are copied into a square canvas so the caps only change
+ * for unusually big cursors */
+#define CURSOR_CANVAS 64
+
+struct cursor_layer {
+	Display *dpy;
+	Window window;
+	int xfixes_event;
+	struct cursor_area area;
+	uint32_t area_width;	// of the window when not cropped
+	uint32_t area_height;
+	/* cursor_layer_place comes from the pipeline threads, the rest is
+	 * the main loop. Both set the pad, so the lock covers the area and
+	 * everything from canvas to moved. */
+	GMutex lock;
+	GstElement *appsrc;
+	GstPad *mixpad;
+	uint32_t canvas;
+	int xhot;
+	int yhot;
+	bool need_image;
+	int32_t last_x;		// pointer in the window, G_MININT32 until polled
+	int32_t last_y;
+	bool visible;
+	double alpha;		// of the window layer it follows
+	double scale_x;		// window layer letterbox, the pointer shrinks with it
+	double scale_y;
+	unsigned int base_zorder;	// above every configured layer
+	unsigned int zorder;	// on the pad now
+	bool moved;		// window layer moved or faded, redo the pad
+	uint32_t images;	// times the image was uploaded
+};
+
+static void cursor_window_size(struct cursor_layer *cursor){
+	XWindowAttributes attr;
+	if(XGetWindowAttributes(cursor->dpy, cursor->window, &attr)){
+		g_mutex_lock(&cursor->lock);
+		cursor->area_width = attr.width;
+		cursor->area_height = attr.height;
+		cursor->moved = true;
+		g_mutex_unlock(&cursor->lock);
+	}
+}
+
+/* called locked, from the poll when the pointer moves and from
+ * cursor_layer_place so a scene change lands on the same frame as the
+ * window it follows */
+static void cursor_apply(struct cursor_layer *cursor){
+	if(cursor->last_x == G_MININT32)
+		return;
+	struct cursor_area *area = &cursor->area;
+	int32_t win_x = cursor->last_x;
+	int32_t win_y = cursor->last_y;
+	int32_t left = area->use_crop ? area->left : 0;
+	int32_t top = area->use_crop ? area->top : 0;
+	int32_t right = area->use_crop ? area->right : cursor->area_width - 1;
+	int32_t bottom = area->use_crop ? area->bottom : cursor->area_height - 1;
+	bool visible = win_x >= left && win_x <= right && win_y >= top && win_y <= bottom;
+
+	g_object_set(G_OBJECT(cursor->mixpad),
+		"xpos", area->xpos + (int32_t) ((win_x - left - cursor->xhot) * cursor->scale_x),
+		"ypos", area->ypos + (int32_t) ((win_y - top - cursor->yhot) * cursor->scale_y),
+		"width", (gint) (cursor->canvas * cursor->scale_x),
+		"height", (gint) (cursor->canvas * cursor->scale_y), NULL);
+	if(visible != cursor->visible || cursor->moved){
+		g_object_set(G_OBJECT(cursor->mixpad), "alpha", visible ? cursor->alpha : 0.0, NULL);
+		cursor->visible = visible;
+	}
+	cursor->moved = false;
+}
+
+/* XFixes gives premultiplied ARGB in longs, the mixer wants straight alpha
+ * BGRA bytes, which is ARGB in a little endian word */
+static void cursor_push_image(struct cursor_layer *cursor){
+	XFixesCursorImage *image = XFixesGetCursorImage(cursor->dpy);
+	if(image == NULL)
+		return;
+	uint32_t canvas = cursor->canvas;
+	while(image->width > canvas || image->height > canvas)
+		canvas *= 2;
+	if(canvas != cursor->canvas || cursor->images == 0){
+		GstCaps *caps = gst_caps_new_simple("video/x-raw",
+			"format", G_TYPE_STRING, "BGRA",
+			"width", G_TYPE_INT, canvas, "height", G_TYPE_INT, canvas,
+			"framerate", GST_TYPE_FRACTION, 0, 1, NULL);
+		g_object_set(G_OBJECT(cursor->appsrc), "caps", caps, NULL);
+		gst_caps_unref(caps);
+	}
+
+	GstBuffer *buf = gst_buffer_new_allocate(NULL, canvas * canvas * 4, NULL);
+	GstMapInfo info;
+	gst_buffer_map(buf, &info, GST_MAP_WRITE);
+	memset(info.data, 0, info.size);
+	for(int y = 0 ; y < image->height ; y++){
+		uint8_t *row = info.data + y * canvas * 4;
+		for(int x = 0 ; x < image->width ; x++){
+			unsigned long argb = image->pixels[y * image->width + x];
+			uint32_t a = (argb >> 24) & 0xff;
+			uint32_t r = (argb >> 16) & 0xff;
+			uint32_t g = (argb >> 8) & 0xff;
+			uint32_t b = argb & 0xff;
+			if(a != 0 && a != 0xff){
+				r = r * 255 / a;
+				g = g * 255 / a;
+				b = b * 255 / a;
+			}
+			row[x * 4 + 0] = b;
+			row[x * 4 + 1] = g;
+			row[x * 4 + 2] = r;
+			row[x * 4 + 3] = a;
+		}
+	}
+	gst_buffer_unmap(buf, &info);
+	g_mutex_lock(&cursor->lock);
+	cursor->canvas = canvas;
+	cursor->xhot = image->xhot;
+	cursor->yhot = image->yhot;
+	// position depends on the hotspot
+	cursor->moved = true;
+	g_mutex_unlock(&cursor->lock);
+	XFree(image);
+
+	GstFlowReturn ret;
+	g_signal_emit_by_name(cursor->appsrc, "push-buffer", buf, &ret);
+	gst_buffer_unref(buf);
+	cursor->images++;
+	cursor->need_image = false;
+}
+
+static gboolean cursor_poll(gpointer data){
+	struct cursor_layer *cursor = data;
+	Window root, child;
+	int root_x, root_y, win_x, win_y;
+	unsigned int mask;
+
+	while(XPending(cursor->dpy)){
+		XEvent event;
+		XNextEvent(cursor->dpy, &event);
+		if(event.type == cursor->xfixes_event + XFixesCursorNotify)
+			cursor->need_image = true;
+		else if(event.type == ConfigureNotify)
+			cursor_window_size(cursor);
+	}
+	if(cursor->need_image)
+		cursor_push_image(cursor);
+
+	if(!XQueryPointer(cursor->dpy, cursor->window, &root, &child, &root_x, &root_y, &win_x, &win_y, &mask))
+		return TRUE; // pointer on another screen
+
+	g_mutex_lock(&cursor->lock);
+	if(win_x != cursor->last_x || win_y != cursor->last_y || cursor->moved){
+		cursor->last_x = win_x;
+		cursor->last_y = win_y;
+		cursor->moved = true;
+		cursor_apply(cursor);
+	}
+	g_mutex_unlock(&cursor->lock);
+	return TRUE;
+}
+
+struct cursor_layer * add_cursor_layer(GstElement *pipeline, GstElement *mix, const char *display,
+		struct cursor_area *area, unsigned int zorder, uint32_t framerate){
+	int error_base;
+	struct cursor_layer *cursor = g_new0(struct cursor_layer, 1);
+
+	cursor->dpy = XOpenDisplay(display);
+	if(cursor->dpy == NULL){
+		printf("cursor layer could not open display\n");
+		g_free(cursor);
+		return NULL;
+	}
+	if(!XFixesQueryExtension(cursor->dpy, &cursor->xfixes_event, &error_base)){
+		printf("no XFixes, no cursor layer\n");
+		XCloseDisplay(cursor->dpy);
+		g_free(cursor);
+		return NULL;
+	}
+	g_mutex_init(&cursor->lock);
+	cursor->area = *area;
+	cursor->window = area->xid != 0 ? area->xid : DefaultRootWindow(cursor->dpy);
+	cursor->canvas = CURSOR_CANVAS;
+	cursor->need_image = true;
+	cursor->visible = true;
+	cursor->alpha = 1.0;
+	cursor->scale_x = 1.0;
+	cursor->scale_y = 1.0;
+	cursor->base_zorder = zorder;
+	cursor->zorder = zorder;
+	cursor->last_x = G_MININT32;
+	cursor_window_size(cursor);
+	XFixesSelectCursorInput(cursor->dpy, DefaultRootWindow(cursor->dpy), XFixesDisplayCursorNotifyMask);
+	XSelectInput(cursor->dpy, cursor->window, StructureNotifyMask);
+
+	/* a new buffer only when the shape changes, the mixer keeps showing the last one */
+	cursor->appsrc = gst_element_factory_make("appsrc", "cursorsrc");
+	g_object_set(G_OBJECT(cursor->appsrc), "is-live", TRUE, "do-timestamp", TRUE,
+		"format", GST_FORMAT_TIME, NULL);
+	GstElement *cursorup = gst_element_factory_make("glupload", NULL);
+	GstElement *cursorcvt = gst_element_factory_make("glcolorconvert", NULL);
+	gst_bin_add_many(GST_BIN(pipeline), cursor->appsrc, cursorup, cursorcvt, NULL);
+	gst_element_link_many(cursor->appsrc, cursorup, cursorcvt, mix, NULL);
+	GstPad *cvtsrc = gst_element_get_static_pad(cursorcvt, "src");
+	cursor->mixpad = gst_pad_get_peer(cvtsrc);
+	gst_object_unref(cvtsrc);
+	g_object_set(G_OBJECT(cursor->mixpad), "zorder", zorder, NULL);
+
+	g_timeout_add(1000 / (framerate > 0 ? framerate : 30), cursor_poll, cursor);
+	return cursor;
+}
+
+void cursor_layer_place(struct cursor_layer *cursor, int32_t xpos, int32_t ypos,
+		unsigned int zorder, double scale_x, double scale_y, double alpha){
+	g_mutex_lock(&cursor->lock);
+	cursor->area.xpos = xpos;
+	cursor->area.ypos = ypos;
+	cursor->scale_x = scale_x;
+	cursor->scale_y = scale_y;
+	cursor->alpha = alpha;
+	cursor->moved = true;
+	// a scene can lift the window over the layers it was configured under
+	zorder = MAX(cursor->base_zorder, zorder + 1);
+	if(zorder != cursor->zorder){
+		g_object_set(G_OBJECT(cursor->mixpad), "zorder", zorder, NULL);
+		cursor->zorder = zorder;
+	}
+	cursor_apply(cursor);
+	g_mutex_unlock(&cursor->lock);
+}
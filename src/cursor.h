@@ -0,0 +1,52 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITCORDER_CURSOR_H
+#define BITCORDER_CURSOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gst/gst.h>
+
+/* Mouse pointer as its own layer on top of the composite. The image comes
+ * from XFixes and is only pushed when the cursor changes shape. Moving the
+ * mouse only moves the mixer pad, so the captured window under it doesn't
+ * have to be redrawn. */
+
+struct cursor_area {
+	uint32_t xid;		// window the captured area is in, 0 for root
+	bool use_crop;		// area is left..right, top..bottom of the window
+	uint32_t left;
+	uint32_t top;
+	uint32_t right;
+	uint32_t bottom;
+	int32_t xpos;		// where the area is drawn in the composite
+	int32_t ypos;
+};
+
+struct cursor_layer;
+
+struct cursor_layer * add_cursor_layer(GstElement *pipeline, GstElement *mix, const char *display,
+	struct cursor_area *area, unsigned int zorder, uint32_t framerate);
+/* the window layer moved, was letterboxed, faded or restacked, the pad is
+ * set right away so call it from where the window's pad is set. xpos and
+ * ypos are where the area is drawn now, zorder is the window's, the scales
+ * are drawn size over captured size. */
+void cursor_layer_place(struct cursor_layer *cursor, int32_t xpos, int32_t ypos,
+	unsigned int zorder, double scale_x, double scale_y, double alpha);
+
+#endif
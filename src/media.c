@@ -0,0 +1,338 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gst/gst.h>
+#include "media.h"
+#include "budget.h"
+
+#define DECODE_RING 64	// frames in the decoder at once, more than any reorder depth
+
+struct decode_entry {
+	GstClockTime pts;
+	gint64 in;		// monotonic, when it went into the decoder
+};
+
+struct media_layer {
+	char *name;
+	char *uri;
+	bool live;
+	bool loop;
+	uint32_t threads;
+	GstElement *lookahead;
+	GstElement *sink;	// where decoded video goes
+	GstElement *decoder;
+	bool linked;
+	// decode time, the decoder's sink and src can be different threads
+	GMutex lock;
+	struct decode_entry ring[DECODE_RING];
+	int ring_next;
+	uint32_t frames;
+	gint64 decode_total;
+	gint64 decode_max;
+	gint loops;
+};
+
+static bool media_is_live(const char *uri){
+	return g_str_has_prefix(uri, "rtp://") || g_str_has_prefix(uri, "srt://")
+		|| g_str_has_prefix(uri, "udp://") || g_str_has_prefix(uri, "rtsp://");
+}
+
+static GstPadProbeReturn decode_in_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct media_layer *media = data;
+	GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+	if(!GST_CLOCK_TIME_IS_VALID(pts))
+		return GST_PAD_PROBE_OK;
+	g_mutex_lock(&media->lock);
+	media->ring[media->ring_next].pts = pts;
+	media->ring[media->ring_next].in = g_get_monotonic_time();
+	media->ring_next = (media->ring_next + 1) % DECODE_RING;
+	g_mutex_unlock(&media->lock);
+	return GST_PAD_PROBE_OK;
+}
+
+/* frames come out in display order, so match them by timestamp */
+static GstPadProbeReturn decode_out_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct media_layer *media = data;
+	GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+	gint64 now = g_get_monotonic_time();
+	g_mutex_lock(&media->lock);
+	media->frames++;
+	for(int i = 0 ; i < DECODE_RING && GST_CLOCK_TIME_IS_VALID(pts) ; i++){
+		struct decode_entry *entry = &media->ring[i];
+		if(entry->in == 0 || entry->pts != pts)
+			continue;
+		gint64 took = now - entry->in;
+		media->decode_total += took;
+		if(took > media->decode_max)
+			media->decode_max = took;
+		entry->in = 0;
+		break;
+	}
+	g_mutex_unlock(&media->lock);
+	return GST_PAD_PROBE_OK;
+}
+
+/* The first video decoder in the decodebin gets the thread cap and the
+ * timing probes. Hardware decoders have no max-threads, they don't need it. */
+static void media_element_added(GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer data){
+	struct media_layer *media = data;
+	const gchar *klass = gst_element_get_metadata(element, GST_ELEMENT_METADATA_KLASS);
+	if(media->decoder != NULL || klass == NULL)
+		return;
+	if(strstr(klass, "Decoder") == NULL || strstr(klass, "Video") == NULL)
+		return;
+	media->decoder = element;
+	printf("media %s decoder %s\n", media->name, GST_OBJECT_NAME(element));
+	if(g_object_class_find_property(G_OBJECT_GET_CLASS(element), "max-threads") != NULL){
+		printf("media %s decoding with %u threads\n", media->name, media->threads);
+		g_object_set(G_OBJECT(element), "max-threads", (gint) media->threads, NULL);
+	}
+	GstPad *sinkpad = gst_element_get_static_pad(element, "sink");
+	GstPad *srcpad = gst_element_get_static_pad(element, "src");
+	if(sinkpad != NULL){
+		gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER,
+			(GstPadProbeCallback) decode_in_probe, media, NULL);
+		gst_object_unref(sinkpad);
+	}
+	if(srcpad != NULL){
+		gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_BUFFER,
+			(GstPadProbeCallback) decode_out_probe, media, NULL);
+		gst_object_unref(srcpad);
+	}
+}
+
+/* First video pad goes to the layer. Audio and anything else is thrown
+ * away, it has to go somewhere or the demuxer stops. */
+static void media_pad_added(GstElement *dec, GstPad *pad, gpointer data){
+	struct media_layer *media = data;
+	GstCaps *caps = gst_pad_get_current_caps(pad);
+	if(caps == NULL)
+		caps = gst_pad_query_caps(pad, NULL);
+	const gchar *type = gst_caps_is_empty(caps) ? "none" : gst_structure_get_name(gst_caps_get_structure(caps, 0));
+	bool video = g_str_has_prefix(type, "video/");
+	printf("media %s pad %s %s\n", media->name, GST_PAD_NAME(pad), type);
+	gst_caps_unref(caps);
+
+	if(video && !media->linked){
+		GstPad *sinkpad = gst_element_get_static_pad(media->lookahead, "sink");
+		if(gst_pad_link(pad, sinkpad) == GST_PAD_LINK_OK)
+			media->linked = true;
+		else
+			printf("media %s could not link video\n", media->name);
+		gst_object_unref(sinkpad);
+		return;
+	}
+	GstElement *bin = GST_ELEMENT(gst_element_get_parent(dec));
+	GstElement *fake = gst_element_factory_make("fakesink", NULL);
+	g_object_set(G_OBJECT(fake), "sync", FALSE, "async", FALSE, NULL);
+	gst_bin_add(GST_BIN(bin), fake);
+	gst_element_sync_state_with_parent(fake);
+	GstPad *fakepad = gst_element_get_static_pad(fake, "sink");
+	gst_pad_link(pad, fakepad);
+	gst_object_unref(fakepad);
+	gst_object_unref(bin);
+}
+
+static gboolean media_rewind(gpointer data){
+	struct media_layer *media = data;
+	GstPad *srcpad = gst_element_get_static_pad(media->lookahead, "src");
+	GstEvent *seek = gst_event_new_seek(1.0, GST_FORMAT_TIME,
+		GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT,
+		GST_SEEK_TYPE_SET, 0, GST_SEEK_TYPE_NONE, GST_CLOCK_TIME_NONE);
+	if(!gst_pad_send_event(srcpad, seek))
+		printf("media %s can't seek, not looping\n", media->name);
+	gst_object_unref(srcpad);
+	return G_SOURCE_REMOVE;
+}
+
+/* Between the lookahead and the rest of the layer. A file's timestamps
+ * start at 0 every time through, so each new segment starts now in running
+ * time. Looping eats the EOS and the flushes of the seek back, the mixer
+ * never sees them. */
+static GstPadProbeReturn media_timeline_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct media_layer *media = data;
+	GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+
+	switch(GST_EVENT_TYPE(event)){
+	case GST_EVENT_EOS:
+		if(!media->loop)
+			return GST_PAD_PROBE_OK;
+		g_atomic_int_inc(&media->loops);
+		g_idle_add(media_rewind, media);
+		return GST_PAD_PROBE_DROP;
+	case GST_EVENT_FLUSH_START:
+	case GST_EVENT_FLUSH_STOP:
+		return media->loop ? GST_PAD_PROBE_DROP : GST_PAD_PROBE_OK;
+	case GST_EVENT_SEGMENT:
+		if(media->live)
+			return GST_PAD_PROBE_OK; // already in running time
+		{
+			GstClock *clock = gst_element_get_clock(media->lookahead);
+			if(clock == NULL)
+				return GST_PAD_PROBE_OK; // not playing yet, 0 is now
+			GstClockTime now = gst_clock_get_time(clock) - gst_element_get_base_time(media->lookahead);
+			gst_object_unref(clock);
+
+			const GstSegment *old;
+			gst_event_parse_segment(event, &old);
+			if(old->format != GST_FORMAT_TIME)
+				return GST_PAD_PROBE_OK;
+			GstSegment segment;
+			gst_segment_copy_into(old, &segment);
+			segment.base = now;
+			GstEvent *moved = gst_event_new_segment(&segment);
+			gst_event_set_seqnum(moved, gst_event_get_seqnum(event));
+			gst_event_unref(event);
+			GST_PAD_PROBE_INFO_DATA(info) = moved;
+		}
+		return GST_PAD_PROBE_OK;
+	default:
+		return GST_PAD_PROBE_OK;
+	}
+}
+
+/* rtp://host:port or rtp://@:port, MPEG-TS payload like --rtp sends */
+static GstElement * media_rtp_source(GstElement *pipeline, struct media_layer *media){
+	const char *where = media->uri + strlen("rtp://");
+	const char *colon = strrchr(where, ':');
+	if(colon == NULL){
+		printf("media %s: rtp://host:port needs a port\n", media->name);
+		return NULL;
+	}
+	char *host = g_strndup(where, colon - where);
+	int port = strtol(colon + 1, NULL, 0);
+
+	GstElement *udp = gst_element_factory_make("udpsrc", NULL);
+	g_object_set(G_OBJECT(udp), "port", port, NULL);
+	if(host[0] != '\0' && strcmp(host, "@") != 0)
+		g_object_set(G_OBJECT(udp), "address", host, NULL);
+	GstCaps *caps = gst_caps_new_simple("application/x-rtp",
+		"media", G_TYPE_STRING, "video", "encoding-name", G_TYPE_STRING, "MP2T",
+		"clock-rate", G_TYPE_INT, 90000, NULL);
+	g_object_set(G_OBJECT(udp), "caps", caps, NULL);
+	gst_caps_unref(caps);
+	printf("media %s listening on %s port %d\n", media->name, host[0] != '\0' ? host : "@", port);
+	g_free(host);
+
+	GstElement *jitter = gst_element_factory_make("rtpjitterbuffer", NULL);
+	GstElement *depay = gst_element_factory_make("rtpmp2tdepay", NULL);
+	GstElement *dec = gst_element_factory_make("decodebin", NULL);
+	gst_bin_add_many(GST_BIN(pipeline), udp, jitter, depay, dec, NULL);
+	gst_element_link_many(udp, jitter, depay, dec, NULL);
+	return dec;
+}
+
+struct media_layer * media_layer_new(GstElement *pipeline, const char *name,
+		struct media_options *opt, GstElement *sink){
+	struct media_layer *media = g_new0(struct media_layer, 1);
+	GstElement *dec;
+	media->name = g_strdup(name);
+	if(gst_uri_is_valid(opt->uri))
+		media->uri = g_strdup(opt->uri);
+	else
+		media->uri = gst_filename_to_uri(opt->uri, NULL);
+	if(media->uri == NULL){
+		printf("media %s: can't make a uri of %s\n", name, opt->uri);
+		g_free(media->name);
+		g_free(media);
+		return NULL;
+	}
+	media->live = media_is_live(media->uri);
+	media->loop = opt->loop && !media->live;
+	media->threads = opt->threads;
+	media->sink = sink;
+	g_mutex_init(&media->lock);
+	printf("media %s: %s%s%s\n", name, media->uri, media->live ? " live" : "",
+		media->loop ? " looping" : "");
+
+	if(g_str_has_prefix(media->uri, "rtp://")){
+		dec = media_rtp_source(pipeline, media);
+		if(dec == NULL){
+			g_free(media->uri);
+			g_free(media->name);
+			g_free(media);
+			return NULL;
+		}
+	} else {
+		dec = gst_element_factory_make("uridecodebin", NULL);
+		g_object_set(G_OBJECT(dec), "uri", media->uri, NULL);
+		gst_bin_add(GST_BIN(pipeline), dec);
+	}
+	g_signal_connect(dec, "pad-added", G_CALLBACK(media_pad_added), media);
+	g_signal_connect(dec, "deep-element-added", G_CALLBACK(media_element_added), media);
+
+	/* Decoded frames the decoder may work ahead by. Only time bounds it,
+	 * so a 4K file doesn't keep more memory around than it needs to. */
+	gchar *qname = g_strdup_printf("%s_lookahead", name);
+	media->lookahead = gst_element_factory_make("queue", qname);
+	g_free(qname);
+	g_object_set(G_OBJECT(media->lookahead), "max-size-buffers", 0, "max-size-bytes", 0,
+		"max-size-time", (guint64) opt->lookahead_ms * GST_MSECOND, NULL);
+	/* otherwise it becomes a 3 frame raw video queue */
+	memory_budget_keep(media->lookahead);
+	gst_bin_add(GST_BIN(pipeline), media->lookahead);
+	GstPad *srcpad = gst_element_get_static_pad(media->lookahead, "src");
+	gst_pad_add_probe(srcpad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM | GST_PAD_PROBE_TYPE_EVENT_FLUSH,
+		(GstPadProbeCallback) media_timeline_probe, media, NULL);
+	gst_object_unref(srcpad);
+
+	/* A file would be decoded as fast as the lookahead empties, and the
+	 * layer only keeps the newest frame, so play it out at its own rate.
+	 * Live sources already come at their rate. No conversion here, so
+	 * glupload gets the decoder's memory as it is, dmabuf or VA included. */
+	if(media->live){
+		gst_element_link(media->lookahead, sink);
+	} else {
+		GstElement *pace = gst_element_factory_make("identity", NULL);
+		g_object_set(G_OBJECT(pace), "sync", TRUE, NULL);
+		gst_bin_add(GST_BIN(pipeline), pace);
+		gst_element_link_many(media->lookahead, pace, sink, NULL);
+	}
+	return media;
+}
+
+void media_layer_hold_last(struct media_layer *media, GstPad *mixpad){
+	if(media->loop || mixpad == NULL)
+		return;
+	if(g_object_class_find_property(G_OBJECT_GET_CLASS(mixpad), "repeat-after-eos") != NULL)
+		g_object_set(G_OBJECT(mixpad), "repeat-after-eos", TRUE, NULL);
+}
+
+gboolean media_print_stats(gpointer data){
+	struct media_layer *media = data;
+	guint64 level_time = 0;
+	guint level_buffers = 0;
+	g_object_get(G_OBJECT(media->lookahead), "current-level-time", &level_time,
+		"current-level-buffers", &level_buffers, NULL);
+	g_mutex_lock(&media->lock);
+	uint32_t frames = media->frames;
+	gint64 total = media->decode_total;
+	gint64 max = media->decode_max;
+	g_mutex_unlock(&media->lock);
+
+	printf("media %s: frames %u decode avg %.1f ms max %.1f ms lookahead %.0f ms %u frames",
+		media->name, frames, frames > 0 ? total / 1000.0 / frames : 0.0, max / 1000.0,
+		(double) level_time / GST_MSECOND, level_buffers);
+	if(media->loop)
+		printf(" loops %d", g_atomic_int_get(&media->loops));
+	printf("\n");
+	return TRUE;
+}
@@ -0,0 +1,53 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITCORDER_MEDIA_H
+#define BITCORDER_MEDIA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gst/gst.h>
+
+/* Video layers from a decoder: a file, an srt:// stream, or rtp://@:port
+ * carrying MPEG-TS like --rtp sends. Decoded frames go straight to the
+ * layer's glupload, so a hardware decoder's surfaces are imported without a
+ * copy. A bounded queue lets the decoder work ahead. Files are paced to the
+ * pipeline clock and can loop. Audio in the media is not used. */
+
+#define MAX_MEDIA 4
+#define MEDIA_DEFAULT_THREADS 2
+#define MEDIA_DEFAULT_LOOKAHEAD_MS 500
+
+struct media_options {
+	char * uri;		// uri or file name
+	bool loop;
+	uint32_t threads;	// decoder threads, software decoders only
+	uint32_t lookahead_ms;	// decoded frames kept ahead of the mixer
+};
+
+struct media_layer;
+
+/* decoded video is linked to sink, the first element of the layer */
+struct media_layer * media_layer_new(GstElement *pipeline, const char *name,
+	struct media_options *opt, GstElement *sink);
+/* keeps showing the last frame when a file ends without looping */
+void media_layer_hold_last(struct media_layer *media, GstPad *mixpad);
+
+/* g_timeout_add callback, prints decode time and how far ahead it is */
+gboolean media_print_stats(gpointer data);
+
+#endif
@@ -0,0 +1,436 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <gst/gst.h>
+#include <gst/app/app.h>
+#include "rtmp.h"
+#include "startup.h"
+
+#define RTMP_STABLE_US (10 * G_USEC_PER_SEC)	// up this long and backoff starts over
+
+enum rtmp_state { RTMP_DOWN = 0, RTMP_UP };
+
+struct rtmp_track {
+	struct rtmp_output *rtmp;
+	bool video;
+	GstElement *appsrc;
+	GstCaps *caps;		// last from the main pipeline, appsrc keeps it over NULL
+};
+
+struct rtmp_item {
+	GstBuffer *buffer;	// timestamps already in running time
+	bool video;
+};
+
+struct rtmp_output {
+	GstElement *main;	// clock and base time come from here
+	GstElement *pipeline;
+	GstElement *videosink;	// appsink, keyframe requests go up from here
+	struct rtmp_track video;
+	struct rtmp_track audio;
+	uint32_t backlog_ms;
+	guint retry_id;
+	uint32_t backoff_ms;
+	// everything below is shared with the streaming threads
+	GMutex lock;
+	enum rtmp_state state;
+	bool started;		// first sample asked for the first connection
+	bool need_keyframe;
+	GQueue backlog;
+	uint64_t backlog_bytes;
+	GstClockTime replay_ns;	// backlog sent on reconnecting, until the server catches up
+	uint64_t pushed;	// bytes into the appsrcs since connecting
+	uint64_t muxed;		// bytes into flvmux since connecting
+	uint32_t rendered;	// buffers at rtmpsink since connecting
+	gint64 up_since;
+	gint64 down_since;	// 0 before the first connection
+	uint32_t attempts;
+	uint32_t reconnects;
+	gint64 last_reconnect;
+	gint64 max_reconnect;
+	uint64_t dropped;	// bytes that never got to the muxer
+};
+
+static gboolean rtmp_connect(gpointer data);
+static void rtmp_request_keyframe(struct rtmp_output *rtmp);
+
+static void rtmp_item_free(gpointer data){
+	struct rtmp_item *item = data;
+	gst_buffer_unref(item->buffer);
+	g_free(item);
+}
+
+static bool rtmp_is_keyframe(bool video, GstBuffer *buffer){
+	return video && !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+}
+
+static void rtmp_backlog_drop_head(struct rtmp_output *rtmp){
+	struct rtmp_item *oldest = g_queue_pop_head(&rtmp->backlog);
+	gsize size = gst_buffer_get_size(oldest->buffer);
+	rtmp->backlog_bytes -= size;
+	rtmp->dropped += size;
+	rtmp_item_free(oldest);
+}
+
+/* Held while down. It always starts with a keyframe, the oldest one within
+ * backlog_ms of the newest buffer, or the newest keyframe when none is, so
+ * 0 keeps just the newest keyframe and what follows it. Called locked. */
+static void rtmp_backlog_add(struct rtmp_output *rtmp, GstBuffer *buffer, bool video){
+	bool keyframe = rtmp_is_keyframe(video, buffer);
+	if(g_queue_is_empty(&rtmp->backlog) && !keyframe){
+		rtmp->dropped += gst_buffer_get_size(buffer);
+		gst_buffer_unref(buffer);
+		return;
+	}
+	struct rtmp_item *item = g_new(struct rtmp_item, 1);
+	item->buffer = buffer;
+	item->video = video;
+	g_queue_push_tail(&rtmp->backlog, item);
+	rtmp->backlog_bytes += gst_buffer_get_size(buffer);
+
+	GstClockTime newest = GST_BUFFER_PTS(buffer);
+	GstClockTime window = rtmp->backlog_ms * GST_MSECOND;
+	struct rtmp_item *oldest = g_queue_peek_head(&rtmp->backlog);
+	if(!GST_CLOCK_TIME_IS_VALID(newest) || newest < GST_BUFFER_PTS(oldest->buffer)
+			|| newest - GST_BUFFER_PTS(oldest->buffer) <= window)
+		return; // the head keyframe is still in the window, the usual case
+
+	/* first keyframe in the window, or failing that the last one */
+	GList *keep = NULL;
+	for(GList *l = rtmp->backlog.head->next ; l != NULL ; l = l->next){
+		struct rtmp_item *held = l->data;
+		if(!rtmp_is_keyframe(held->video, held->buffer))
+			continue;
+		keep = l;
+		if(GST_BUFFER_PTS(held->buffer) >= newest - MIN(window, newest))
+			break;
+	}
+	if(keep == NULL)
+		return; // nothing to start from but the head
+	while(rtmp->backlog.head != keep)
+		rtmp_backlog_drop_head(rtmp);
+}
+
+static uint64_t rtmp_backlog_ms(struct rtmp_output *rtmp){
+	struct rtmp_item *first = g_queue_peek_head(&rtmp->backlog);
+	struct rtmp_item *last = g_queue_peek_tail(&rtmp->backlog);
+	if(first == NULL || GST_BUFFER_PTS(last->buffer) < GST_BUFFER_PTS(first->buffer))
+		return 0;
+	return (GST_BUFFER_PTS(last->buffer) - GST_BUFFER_PTS(first->buffer)) / GST_MSECOND;
+}
+
+/* Called locked. After a reconnect with nothing held the stream has to
+ * start on a keyframe, audio included, or the server gets a header and
+ * then frames it can't decode. A server that takes data slower than it
+ * comes fills the appsrc queue, so past backlog_ms of it, plus whatever
+ * backlog was replayed into it on reconnecting, everything is dropped until
+ * the next keyframe. The replay itself is never dropped. Returns false
+ * when it starts waiting for one. */
+static bool rtmp_push(struct rtmp_output *rtmp, struct rtmp_track *track, GstBuffer *buffer, bool replay){
+	guint64 queued = 0;
+	GstClockTime bound = MAX(rtmp->backlog_ms, RTMP_QUEUE_MIN_MS) * GST_MSECOND;
+	if(!replay){
+		g_object_get(G_OBJECT(track->appsrc), "current-level-time", &queued, NULL);
+		if(queued <= bound)
+			rtmp->replay_ns = 0; // caught up
+	}
+	if(queued > bound + rtmp->replay_ns){
+		bool waiting = rtmp->need_keyframe;
+		if(!waiting)
+			printf("rtmp server is behind by %.1f s, dropping until a keyframe\n",
+				queued / (double) GST_SECOND);
+		rtmp->need_keyframe = true;
+		rtmp->dropped += gst_buffer_get_size(buffer);
+		gst_buffer_unref(buffer);
+		return waiting;
+	}
+	if(rtmp->need_keyframe){
+		if(!rtmp_is_keyframe(track->video, buffer)){
+			rtmp->dropped += gst_buffer_get_size(buffer);
+			gst_buffer_unref(buffer);
+			return true;
+		}
+		rtmp->need_keyframe = false;
+	}
+	rtmp->pushed += gst_buffer_get_size(buffer);
+	gst_app_src_push_buffer(GST_APP_SRC(track->appsrc), buffer);
+	return true;
+}
+
+/* main pipeline streaming thread */
+static GstFlowReturn rtmp_new_sample(GstAppSink *sink, gpointer data){
+	struct rtmp_track *track = data;
+	struct rtmp_output *rtmp = track->rtmp;
+	GstSample *sample = gst_app_sink_pull_sample(sink);
+	if(sample == NULL)
+		return GST_FLOW_OK;
+	GstCaps *caps = gst_sample_get_caps(sample);
+	const GstSegment *segment = gst_sample_get_segment(sample);
+	GstBuffer *buffer = gst_buffer_copy(gst_sample_get_buffer(sample)); // metadata only, memory is shared
+
+	/* same clock and base time on both pipelines, so running time carries over */
+	if(GST_BUFFER_PTS_IS_VALID(buffer))
+		GST_BUFFER_PTS(buffer) = gst_segment_to_running_time(segment, GST_FORMAT_TIME, GST_BUFFER_PTS(buffer));
+	if(GST_BUFFER_DTS_IS_VALID(buffer))
+		GST_BUFFER_DTS(buffer) = gst_segment_to_running_time(segment, GST_FORMAT_TIME, GST_BUFFER_DTS(buffer));
+
+	bool keyframe = false;
+	g_mutex_lock(&rtmp->lock);
+	if(caps != NULL && (track->caps == NULL || !gst_caps_is_equal(caps, track->caps))){
+		gst_caps_replace(&track->caps, caps);
+		gst_app_src_set_caps(GST_APP_SRC(track->appsrc), caps);
+	}
+	if(rtmp->state == RTMP_UP)
+		keyframe = !rtmp_push(rtmp, track, buffer, false);
+	else
+		rtmp_backlog_add(rtmp, buffer, track->video);
+	bool first = !rtmp->started;
+	rtmp->started = true;
+	g_mutex_unlock(&rtmp->lock);
+	gst_sample_unref(sample);
+
+	if(keyframe)
+		rtmp_request_keyframe(rtmp);
+
+	/* main pipeline is playing now, it has a clock and base time to share */
+	if(first)
+		g_idle_add(rtmp_connect, rtmp);
+	return GST_FLOW_OK;
+}
+
+static GstPadProbeReturn rtmp_muxed_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct rtmp_output *rtmp = data;
+	gsize size = gst_buffer_get_size(GST_PAD_PROBE_INFO_BUFFER(info));
+	g_mutex_lock(&rtmp->lock);
+	rtmp->muxed += size;
+	g_mutex_unlock(&rtmp->lock);
+	return GST_PAD_PROBE_OK;
+}
+
+/* rtmpsink connects when it gets its first buffer, so the second one
+ * arriving means the connection is up and taking data */
+static GstPadProbeReturn rtmp_rendered_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct rtmp_output *rtmp = data;
+	g_mutex_lock(&rtmp->lock);
+	if(++rtmp->rendered == 2){
+		if(rtmp->down_since == 0){
+			printf("rtmp connected\n");
+		} else {
+			gint64 took = g_get_monotonic_time() - rtmp->down_since;
+			rtmp->reconnects++;
+			rtmp->last_reconnect = took;
+			if(took > rtmp->max_reconnect)
+				rtmp->max_reconnect = took;
+			printf("rtmp reconnected after %.2f s, %" G_GUINT64_FORMAT " bytes dropped so far\n",
+				took / (double) G_USEC_PER_SEC, rtmp->dropped);
+		}
+	}
+	g_mutex_unlock(&rtmp->lock);
+	return GST_PAD_PROBE_OK;
+}
+
+static void rtmp_request_keyframe(struct rtmp_output *rtmp){
+	GstPad *sinkpad = gst_element_get_static_pad(rtmp->videosink, "sink");
+	GstStructure *s = gst_structure_new("GstForceKeyUnit", "all-headers", G_TYPE_BOOLEAN, TRUE, NULL);
+	gst_pad_send_event(sinkpad, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM, s));
+	gst_object_unref(sinkpad);
+}
+
+static void rtmp_retry_later(struct rtmp_output *rtmp);
+
+/* main loop, from an error on the rtmp bus or a failed start */
+static void rtmp_down(struct rtmp_output *rtmp, const char *why){
+	gint64 now = g_get_monotonic_time();
+	g_mutex_lock(&rtmp->lock);
+	if(rtmp->state == RTMP_UP){
+		rtmp->state = RTMP_DOWN;
+		rtmp->down_since = now;
+		if(rtmp->pushed > rtmp->muxed)
+			rtmp->dropped += rtmp->pushed - rtmp->muxed;
+		if(now - rtmp->up_since > RTMP_STABLE_US)
+			rtmp->backoff_ms = RTMP_RETRY_MIN_MS;
+	}
+	g_mutex_unlock(&rtmp->lock);
+	printf("rtmp down: %s, retry in %.1f s\n", why, rtmp->backoff_ms / 1000.0);
+	// FIXME a dead peer without a reset takes librtmp's own timeout to notice
+	gst_element_set_state(rtmp->pipeline, GST_STATE_NULL);
+	rtmp_retry_later(rtmp);
+}
+
+static gboolean rtmp_connect(gpointer data){
+	struct rtmp_output *rtmp = data;
+	rtmp->retry_id = 0;
+	GstClock *clock = gst_element_get_clock(rtmp->main);
+	if(clock == NULL){
+		rtmp_retry_later(rtmp);
+		return G_SOURCE_REMOVE;
+	}
+	gst_pipeline_use_clock(GST_PIPELINE(rtmp->pipeline), clock);
+	gst_object_unref(clock);
+	gst_element_set_start_time(rtmp->pipeline, GST_CLOCK_TIME_NONE);
+	gst_element_set_base_time(rtmp->pipeline, gst_element_get_base_time(rtmp->main));
+
+	rtmp->attempts++;
+	if(rtmp->attempts > 1)
+		printf("rtmp reconnecting, attempt %u\n", rtmp->attempts);
+	if(gst_element_set_state(rtmp->pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE){
+		rtmp_down(rtmp, "pipeline won't start");
+		return G_SOURCE_REMOVE;
+	}
+
+	/* what was held goes first, in order, before anything new */
+	g_mutex_lock(&rtmp->lock);
+	rtmp->pushed = 0;
+	rtmp->muxed = 0;
+	rtmp->rendered = 0;
+	rtmp->up_since = g_get_monotonic_time();
+	rtmp->need_keyframe = g_queue_is_empty(&rtmp->backlog);
+	rtmp->replay_ns = rtmp_backlog_ms(rtmp) * GST_MSECOND;
+	struct rtmp_item *item;
+	while((item = g_queue_pop_head(&rtmp->backlog)) != NULL){
+		rtmp_push(rtmp, item->video ? &rtmp->video : &rtmp->audio, item->buffer, true);
+		g_free(item);
+	}
+	rtmp->backlog_bytes = 0;
+	rtmp->state = RTMP_UP;
+	g_mutex_unlock(&rtmp->lock);
+
+	/* a fresh one either way, the backlog may be seconds old by now */
+	rtmp_request_keyframe(rtmp);
+	return G_SOURCE_REMOVE;
+}
+
+static void rtmp_retry_later(struct rtmp_output *rtmp){
+	if(rtmp->retry_id != 0)
+		g_source_remove(rtmp->retry_id);
+	rtmp->retry_id = g_timeout_add(rtmp->backoff_ms, rtmp_connect, rtmp);
+	rtmp->backoff_ms = MIN(rtmp->backoff_ms * 2, RTMP_RETRY_MAX_MS);
+}
+
+static gboolean rtmp_bus(GstBus *bus, GstMessage *message, gpointer data){
+	struct rtmp_output *rtmp = data;
+	if(GST_MESSAGE_TYPE(message) != GST_MESSAGE_ERROR)
+		return TRUE;
+	GError *err = NULL;
+	gchar *debug = NULL;
+	gst_message_parse_error(message, &err, &debug);
+	printf("rtmp error from %s: %s\n", GST_OBJECT_NAME(GST_MESSAGE_SRC(message)), err->message);
+	if(rtmp->state == RTMP_UP)
+		rtmp_down(rtmp, err->message);
+	g_error_free(err);
+	g_free(debug);
+	return TRUE;
+}
+
+static GstElement * rtmp_add_appsink(GstElement *pipeline, GstElement *queue, struct rtmp_track *track){
+	GstElement *sink = gst_element_factory_make("appsink", track->video ? "rtmp_videosink" : "rtmp_audiosink");
+	g_object_set(G_OBJECT(sink), "sync", FALSE, "async", FALSE, NULL);
+	GstAppSinkCallbacks callbacks = { 0 };
+	callbacks.new_sample = rtmp_new_sample;
+	gst_app_sink_set_callbacks(GST_APP_SINK(sink), &callbacks, track, NULL);
+	gst_bin_add(GST_BIN(pipeline), sink);
+	gst_element_link(queue, sink);
+	return sink;
+}
+
+static GstElement * rtmp_add_appsrc(struct rtmp_output *rtmp, struct rtmp_track *track, const char *name){
+	track->rtmp = rtmp;
+	track->appsrc = gst_element_factory_make("appsrc", name);
+	g_object_set(G_OBJECT(track->appsrc), "format", GST_FORMAT_TIME, "is-live", TRUE,
+		"do-timestamp", FALSE, NULL);
+	gst_bin_add(GST_BIN(rtmp->pipeline), track->appsrc);
+	return track->appsrc;
+}
+
+static void rtmp_link_mux(struct rtmp_output *rtmp, GstElement *from, GstElement *mux, const char *padname){
+	GstPad *srcpad = gst_element_get_static_pad(from, "src");
+	GstPad *muxpad = gst_element_get_request_pad(mux, padname);
+	gst_pad_link(srcpad, muxpad);
+	gst_pad_add_probe(muxpad, GST_PAD_PROBE_TYPE_BUFFER,
+		(GstPadProbeCallback) rtmp_muxed_probe, rtmp, NULL);
+	gst_object_unref(srcpad);
+	gst_object_unref(muxpad);
+}
+
+struct rtmp_output * rtmp_output_new(GstElement *pipeline, GstElement *videoqueue,
+		GstElement *audioqueue, const char *location, uint32_t backlog_ms){
+	struct rtmp_output *rtmp = g_new0(struct rtmp_output, 1);
+	rtmp->main = pipeline;
+	rtmp->backlog_ms = backlog_ms;
+	rtmp->backoff_ms = RTMP_RETRY_MIN_MS;
+	rtmp->state = RTMP_DOWN;
+	g_mutex_init(&rtmp->lock);
+	g_queue_init(&rtmp->backlog);
+
+	/* appsrc ! h264parse ! flvmux ! rtmpsink, parse turns byte-stream from
+	 * the shared encoder into the avc flv wants */
+	rtmp->pipeline = gst_pipeline_new("rtmp");
+	GstElement *mux = gst_element_factory_make("flvmux", "flashmux");
+	GstElement *sink = gst_element_factory_make("rtmpsink", "streamsink");
+	GstElement *parse = gst_element_factory_make("h264parse", NULL);
+	g_object_set(G_OBJECT(mux), "streamable", TRUE, NULL);
+	g_object_set(G_OBJECT(sink), "location", location, "sync", FALSE, NULL);
+	gst_bin_add_many(GST_BIN(rtmp->pipeline), parse, mux, sink, NULL);
+	gst_element_link(mux, sink);
+
+	rtmp->video.video = true;
+	gst_element_link(rtmp_add_appsrc(rtmp, &rtmp->video, "rtmp_videosrc"), parse);
+	rtmp_link_mux(rtmp, parse, mux, "video");
+	rtmp->videosink = rtmp_add_appsink(pipeline, videoqueue, &rtmp->video);
+	if(audioqueue != NULL){
+		rtmp_link_mux(rtmp, rtmp_add_appsrc(rtmp, &rtmp->audio, "rtmp_audiosrc"), mux, "audio");
+		rtmp_add_appsink(pipeline, audioqueue, &rtmp->audio);
+	}
+
+	GstPad *sinkpad = gst_element_get_static_pad(sink, "sink");
+	startup_watch_first(sinkpad, "first rtmp packet");
+	gst_pad_add_probe(sinkpad, GST_PAD_PROBE_TYPE_BUFFER,
+		(GstPadProbeCallback) rtmp_rendered_probe, rtmp, NULL);
+	gst_object_unref(sinkpad);
+
+	GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(rtmp->pipeline));
+	gst_bus_add_watch(bus, rtmp_bus, rtmp);
+	gst_object_unref(bus);
+	printf("rtmp output, %u ms backlog while disconnected\n", backlog_ms);
+	return rtmp;
+}
+
+GstElement * rtmp_output_pipeline(struct rtmp_output *rtmp){
+	return rtmp->pipeline;
+}
+
+gboolean rtmp_output_print_stats(gpointer data){
+	struct rtmp_output *rtmp = data;
+	gint64 now = g_get_monotonic_time();
+	g_mutex_lock(&rtmp->lock);
+	if(rtmp->state == RTMP_UP){
+		printf("rtmp up %.0f s", (now - rtmp->up_since) / (double) G_USEC_PER_SEC);
+	} else {
+		printf("rtmp down %.1f s, holding %" G_GUINT64_FORMAT " ms %" G_GUINT64_FORMAT " bytes",
+			rtmp->down_since != 0 ? (now - rtmp->down_since) / (double) G_USEC_PER_SEC : 0.0,
+			rtmp_backlog_ms(rtmp), rtmp->backlog_bytes);
+	}
+	if(rtmp->reconnects > 0)
+		printf(", %u reconnects took last %.2f s max %.2f s", rtmp->reconnects,
+			rtmp->last_reconnect / (double) G_USEC_PER_SEC, rtmp->max_reconnect / (double) G_USEC_PER_SEC);
+	printf(", %" G_GUINT64_FORMAT " bytes dropped\n", rtmp->dropped);
+	g_mutex_unlock(&rtmp->lock);
+	return TRUE;
+}
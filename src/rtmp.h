@@ -0,0 +1,50 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITCORDER_RTMP_H
+#define BITCORDER_RTMP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gst/gst.h>
+
+/* RTMP in its own pipeline. The main pipeline ends in appsinks after the
+ * rtmp queues, and flvmux and rtmpsink run in a second pipeline on the same
+ * clock. When the connection drops only the second pipeline errors, so
+ * capture, GL, the encoder and the other outputs keep going. It goes back
+ * to NULL, which means a fresh FLV header and connection next time, and
+ * retries with backoff. Meanwhile the encoded stream is kept from the last
+ * keyframe, up to backlog_ms of it, and sent first when it is back. A slow
+ * server can't grow the queue into it past backlog_ms either. */
+
+#define RTMP_DEFAULT_BACKLOG_MS 2000
+#define RTMP_QUEUE_MIN_MS 1000		// appsrc queue bound when backlog_ms is less
+#define RTMP_RETRY_MIN_MS 500
+#define RTMP_RETRY_MAX_MS 30000
+
+struct rtmp_output;
+
+/* audioqueue can be NULL for video only */
+struct rtmp_output * rtmp_output_new(GstElement *pipeline, GstElement *videoqueue,
+	GstElement *audioqueue, const char *location, uint32_t backlog_ms);
+/* for thread policy, it has its own bus */
+GstElement * rtmp_output_pipeline(struct rtmp_output *rtmp);
+
+/* g_timeout_add callback, prints reconnects and bytes dropped */
+gboolean rtmp_output_print_stats(gpointer data);
+
+#endif
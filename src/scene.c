@@ -0,0 +1,246 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <gst/gst.h>
+#include <glib-unix.h>
+#include "scene.h"
+
+struct scene_layer {
+	const char *name;
+	GstPad *mixpad;
+	scene_place_func place;
+	gpointer data;
+	struct scene_state home;	// from the command line
+	struct scene_state now;		// what the mixer pad has
+	double from_alpha;		// crossfade ends
+	double to_alpha;
+};
+
+struct scene_set {
+	struct scene_options *scenes;
+	int count;
+	struct scene_layer layer[MAX_SCENE_LAYERS];
+	int layers;
+	int current;
+	gint requested;			// scene index, -1 for none
+	gint64 request_time;		// monotonic, when it was asked for
+	bool measuring;			// next output frame is the first of the new scene
+	bool fading;
+	GstClockTime fade_start;	// buffer timestamps, so the fade is frame exact
+	GstClockTime fade_length;
+	uint32_t switches;
+	gint64 last_latency;
+	gint64 max_latency;
+	gint64 total_latency;
+};
+
+/* a layer that isn't in the scene stays where it is with alpha 0 */
+static struct scene_state scene_target(struct scene_set *set, int index, struct scene_layer *layer){
+	struct scene_options *scene = &set->scenes[index];
+	struct scene_state state = layer->now;
+	state.alpha = 0.0;
+	for(int i = 0 ; i < scene->places ; i++){
+		struct scene_place *place = &scene->place[i];
+		if(strcmp(place->layer, layer->name) != 0)
+			continue;
+		state.xpos = place->xpos != SCENE_UNSET ? place->xpos : layer->home.xpos;
+		state.ypos = place->ypos != SCENE_UNSET ? place->ypos : layer->home.ypos;
+		state.zorder = place->zorder != SCENE_UNSET ? place->zorder : layer->home.zorder;
+		state.alpha = place->alpha >= 0.0 ? place->alpha : layer->home.alpha;
+		break;
+	}
+	return state;
+}
+
+/* only what changed, every set property is a lock and a notify */
+static void scene_layer_apply(struct scene_layer *layer, const struct scene_state *state){
+	if(state->xpos == layer->now.xpos && state->ypos == layer->now.ypos
+			&& state->zorder == layer->now.zorder && state->alpha == layer->now.alpha)
+		return;
+	if(state->zorder != layer->now.zorder)
+		g_object_set(G_OBJECT(layer->mixpad), "zorder", (guint) state->zorder, NULL);
+	if(state->alpha != layer->now.alpha)
+		g_object_set(G_OBJECT(layer->mixpad), "alpha", state->alpha, NULL);
+	if(layer->place != NULL)
+		layer->place(layer->data, state);
+	else if(state->xpos != layer->now.xpos || state->ypos != layer->now.ypos)
+		g_object_set(G_OBJECT(layer->mixpad), "xpos", state->xpos, "ypos", state->ypos, NULL);
+	layer->now = *state;
+}
+
+/* Cuts go all the way now. Fades move and restack now and leave alpha for
+ * scene_fade_step. */
+static void scene_begin(struct scene_set *set, int index, GstClockTime pts){
+	struct scene_options *scene = &set->scenes[index];
+	set->fading = scene->fade_ms > 0 && GST_CLOCK_TIME_IS_VALID(pts);
+	set->fade_start = pts;
+	set->fade_length = scene->fade_ms * GST_MSECOND;
+	for(int i = 0 ; i < set->layers ; i++){
+		struct scene_layer *layer = &set->layer[i];
+		struct scene_state to = scene_target(set, index, layer);
+		layer->from_alpha = layer->now.alpha;
+		layer->to_alpha = to.alpha;
+		if(set->fading)
+			to.alpha = layer->now.alpha;
+		scene_layer_apply(layer, &to);
+	}
+	set->current = index;
+}
+
+static void scene_fade_step(struct scene_set *set, GstClockTime pts){
+	double t = 1.0;
+	if(GST_CLOCK_TIME_IS_VALID(pts) && pts < set->fade_start + set->fade_length)
+		t = pts > set->fade_start ? (double)(pts - set->fade_start) / set->fade_length : 0.0;
+	for(int i = 0 ; i < set->layers ; i++){
+		struct scene_layer *layer = &set->layer[i];
+		if(layer->from_alpha == layer->to_alpha)
+			continue;
+		struct scene_state state = layer->now;
+		state.alpha = layer->from_alpha + (layer->to_alpha - layer->from_alpha) * t;
+		scene_layer_apply(layer, &state);
+	}
+	if(t >= 1.0)
+		set->fading = false;
+}
+
+/* Mixer output, between one composite and the next. Whatever is set here
+ * is in the next frame. */
+static GstPadProbeReturn scene_frame_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct scene_set *set = data;
+	GstClockTime pts = GST_BUFFER_PTS(GST_PAD_PROBE_INFO_BUFFER(info));
+
+	if(set->measuring){
+		gint64 latency = g_get_monotonic_time() - set->request_time;
+		set->measuring = false;
+		set->switches++;
+		set->last_latency = latency;
+		set->total_latency += latency;
+		if(latency > set->max_latency)
+			set->max_latency = latency;
+		printf("scene %s on screen %.1f ms after it was asked for\n",
+			set->scenes[set->current].name, latency / 1000.0);
+	}
+	if(set->fading)
+		scene_fade_step(set, pts);
+
+	gint requested = g_atomic_int_get(&set->requested);
+	if(requested >= 0 && g_atomic_int_compare_and_exchange(&set->requested, requested, -1)){
+		scene_begin(set, requested, pts);
+		set->measuring = true;
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+static void scene_request(struct scene_set *set, int index){
+	set->request_time = g_get_monotonic_time();
+	g_atomic_int_set(&set->requested, index);
+}
+
+bool scene_switch(struct scene_set *set, const char *name){
+	for(int i = 0 ; i < set->count ; i++){
+		if(strcmp(set->scenes[i].name, name) == 0){
+			scene_request(set, i);
+			return true;
+		}
+	}
+	return false;
+}
+
+static gboolean scene_next(gpointer data){
+	struct scene_set *set = data;
+	gint requested = g_atomic_int_get(&set->requested);
+	scene_request(set, ((requested >= 0 ? requested : set->current) + 1) % set->count);
+	return TRUE;
+}
+
+static gboolean scene_stdin(GIOChannel *channel, GIOCondition condition, gpointer data){
+	struct scene_set *set = data;
+	gchar *line = NULL;
+	if(g_io_channel_read_line(channel, &line, NULL, NULL, NULL) != G_IO_STATUS_NORMAL)
+		return FALSE; // stdin closed, SIGUSR2 still works
+	g_strstrip(line);
+	if(line[0] != '\0' && !scene_switch(set, line)){
+		printf("no scene %s, there is", line);
+		for(int i = 0 ; i < set->count ; i++)
+			printf(" %s", set->scenes[i].name);
+		printf("\n");
+	}
+	g_free(line);
+	return TRUE;
+}
+
+struct scene_set * scene_set_new(struct scene_options *scenes, int count){
+	struct scene_set *set = g_new0(struct scene_set, 1);
+	set->scenes = scenes;
+	set->count = count;
+	set->requested = -1;
+	return set;
+}
+
+void scene_add_layer(struct scene_set *set, const char *name, GstPad *mixpad,
+		const struct scene_state *home, scene_place_func place, gpointer data){
+	if(set->layers >= MAX_SCENE_LAYERS){
+		printf("too many layers for scenes, %s is left out\n", name);
+		return;
+	}
+	struct scene_layer *layer = &set->layer[set->layers++];
+	layer->name = name;
+	layer->mixpad = mixpad;
+	layer->place = place;
+	layer->data = data;
+	layer->home = *home;
+	layer->now = *home;
+}
+
+void scene_start(struct scene_set *set, GstPad *mixsrc){
+	for(int i = 0 ; i < set->count ; i++){
+		struct scene_options *scene = &set->scenes[i];
+		for(int j = 0 ; j < scene->places ; j++){
+			bool found = false;
+			for(int k = 0 ; k < set->layers ; k++)
+				found = found || strcmp(scene->place[j].layer, set->layer[k].name) == 0;
+			if(!found)
+				printf("scene %s: there is no %s layer\n", scene->name, scene->place[j].layer);
+		}
+	}
+	scene_begin(set, 0, GST_CLOCK_TIME_NONE);
+	printf("scene %s\n", set->scenes[0].name);
+	gst_pad_add_probe(mixsrc, GST_PAD_PROBE_TYPE_BUFFER,
+		(GstPadProbeCallback) scene_frame_probe, set, NULL);
+
+	GIOChannel *in = g_io_channel_unix_new(STDIN_FILENO);
+	g_io_add_watch(in, G_IO_IN | G_IO_HUP, scene_stdin, set);
+	g_io_channel_unref(in);
+	g_unix_signal_add(SIGUSR2, scene_next, set);
+}
+
+gboolean scene_print_stats(gpointer data){
+	struct scene_set *set = data;
+	if(set->switches == 0){
+		printf("scene %s, no switches yet\n", set->scenes[set->current].name);
+		return TRUE;
+	}
+	printf("scene %s: %u switches, took last %.1f ms max %.1f ms average %.1f ms\n",
+		set->scenes[set->current].name, set->switches, set->last_latency / 1000.0,
+		set->max_latency / 1000.0, set->total_latency / 1000.0 / set->switches);
+	return TRUE;
+}
@@ -0,0 +1,75 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITCORDER_SCENE_H
+#define BITCORDER_SCENE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gst/gst.h>
+
+/* Scenes are named sets of layers with their place in the composite. Every
+ * layer of every scene is built and running from the start, hidden ones
+ * just have alpha 0 on their mixer pad, so a switch is only pad properties.
+ * They change between two mixer output frames, so the next frame is the
+ * whole new scene, or the first step of a crossfade. Type a scene name on
+ * stdin, or send SIGUSR2 for the next one. */
+
+#define MAX_SCENES 8
+#define MAX_SCENE_LAYERS 16
+#define SCENE_UNSET G_MININT32	// take the layer's own option
+
+struct scene_place {
+	char * layer;		// window, camera, image, region0, region1...
+	int32_t xpos;
+	int32_t ypos;
+	int32_t zorder;
+	double alpha;		// < 0 for the layer's own
+};
+
+struct scene_options {
+	char * name;
+	uint32_t fade_ms;	// crossfade into this scene, 0 cuts
+	struct scene_place place[MAX_SCENE_LAYERS];
+	int places;
+};
+
+/* where a layer is, for the layers that place themselves */
+struct scene_state {
+	int32_t xpos;
+	int32_t ypos;
+	int32_t zorder;
+	double alpha;
+};
+typedef void (*scene_place_func)(gpointer data, const struct scene_state *state);
+
+struct scene_set;
+
+struct scene_set * scene_set_new(struct scene_options *scenes, int count);
+/* home is where the command line put it. place moves the layer instead of
+ * the pad's xpos and ypos, it can be NULL. */
+void scene_add_layer(struct scene_set *set, const char *name, GstPad *mixpad,
+	const struct scene_state *home, scene_place_func place, gpointer data);
+/* shows the first scene and watches the mixer output for frame boundaries */
+void scene_start(struct scene_set *set, GstPad *mixsrc);
+/* any thread, false if there is no such scene */
+bool scene_switch(struct scene_set *set, const char *name);
+
+/* g_timeout_add callback, prints the switch count and how long they took */
+gboolean scene_print_stats(gpointer data);
+
+#endif
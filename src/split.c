@@ -0,0 +1,554 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include "split.h"
+
+#define SHM_RING_MAGIC 0x62697463 /* "bitc" */
+/* the header is mapped on its own, 64k covers every page size we care about */
+#define SHM_RING_HEADER_SIZE 65536
+
+enum shm_slot_state { SLOT_FREE = 0, SLOT_WRITING, SLOT_READY, SLOT_READING };
+
+struct shm_slot {
+	uint32_t state;		// enum shm_slot_state, only touched atomically
+	uint32_t size;
+	uint32_t generation;	// layout the frame was written in
+	uint64_t seq;
+	int64_t stamp;		// g_get_monotonic_time() when the capture side got the frame
+};
+
+/* Lives in the shared memory named after the ring. Each layout has its slots
+ * in a file of their own, the ring name with the generation appended, so a
+ * new layout never writes over frames the encode side still holds. */
+struct shm_ring_header {
+	uint32_t magic;
+	uint32_t slots;
+	uint32_t generation;	// bumped when the capture side changes caps or slot size
+	uint32_t latest;	// slot index of write_seq
+	uint64_t slot_size;
+	uint64_t write_seq;	// last published frame, 0 before the first one
+	char caps[1024];
+	sem_t frame_ready;
+	struct shm_slot slot[SHM_RING_MAX_SLOTS];
+};
+
+/* Consumer mapping of one layout, kept alive by the buffers still using it */
+struct shm_ring_map {
+	gint refcount;
+	uint8_t *base;
+	size_t len;
+	size_t slot_size;
+};
+
+struct shm_slot_ref {
+	struct shm_ring *ring;
+	struct shm_ring_map *map;
+	uint32_t idx;
+};
+
+struct shm_ring {
+	char name[64];
+	int fd;
+	bool owner;
+	struct shm_ring_header *header;
+	uint32_t generation;
+	// capture side
+	uint8_t *data;
+	size_t data_len;
+	// encode side
+	struct shm_ring_map *map;
+	GstElement *appsrc;
+	GThread *reader;
+	gint quit;		// atomic, set by shm_ring_destroy
+	GstBuffer *last;
+	GstClockTime frame_interval;
+	char **capture_argv;
+	GPid capture_pid;
+	// stats, written by one thread and only printed by the main loop
+	uint64_t frames;
+	uint64_t dropped;	// no free slot, or skipped by the reader
+	uint64_t repeated;
+	uint64_t restarts;
+	int64_t cost_total;	// capture side memcpy, encode side capture to push
+	int64_t cost_max;
+	uint64_t cost_count;
+};
+
+static struct shm_ring * shm_ring_open(const char *name, bool owner){
+	struct shm_ring *ring = g_new0(struct shm_ring, 1);
+	int flags = owner ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+
+	G_STATIC_ASSERT(sizeof(struct shm_ring_header) <= SHM_RING_HEADER_SIZE);
+	snprintf(ring->name, sizeof(ring->name), "/%s", name);
+	ring->owner = owner;
+	ring->fd = shm_open(ring->name, flags, 0600);
+	if(ring->fd < 0){
+		printf("shm_open %s failed: %s\n", ring->name, strerror(errno));
+		g_free(ring);
+		return NULL;
+	}
+	if(owner && ftruncate(ring->fd, SHM_RING_HEADER_SIZE) != 0){
+		printf("shm ftruncate failed: %s\n", strerror(errno));
+		shm_ring_destroy(ring);
+		return NULL;
+	}
+	ring->header = mmap(NULL, SHM_RING_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if(ring->header == MAP_FAILED){
+		printf("shm mmap failed: %s\n", strerror(errno));
+		ring->header = NULL;
+		shm_ring_destroy(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+struct shm_ring * shm_ring_create(const char *name, uint32_t slots){
+	struct shm_ring *ring = shm_ring_open(name, true);
+	if(ring == NULL)
+		return NULL;
+	if(slots < 2 || slots > SHM_RING_MAX_SLOTS)
+		slots = SHM_RING_DEFAULT_SLOTS;
+	struct shm_ring_header *hdr = ring->header;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->slots = slots;
+	sem_init(&hdr->frame_ready, 1, 0);
+	__atomic_store_n(&hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+	ring->frame_interval = GST_SECOND / 30;
+	printf("shm ring %s created with %d slots\n", ring->name, slots);
+	return ring;
+}
+
+struct shm_ring * shm_ring_attach(const char *name){
+	struct shm_ring *ring = shm_ring_open(name, false);
+	if(ring == NULL)
+		return NULL;
+	if(__atomic_load_n(&ring->header->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC){
+		printf("shm ring %s not initialized by the encode process\n", ring->name);
+		shm_ring_destroy(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+static void shm_ring_data_name(struct shm_ring *ring, uint32_t generation, char *name, size_t len){
+	snprintf(name, len, "%s.%u", ring->name, generation);
+}
+
+static void shm_ring_map_unref(struct shm_ring_map *map){
+	if(map != NULL && g_atomic_int_dec_and_test(&map->refcount)){
+		munmap(map->base, map->len);
+		g_free(map);
+	}
+}
+
+void shm_ring_destroy(struct shm_ring *ring){
+	if(ring == NULL)
+		return;
+	if(ring->reader != NULL){
+		g_atomic_int_set(&ring->quit, 1);
+		sem_post(&ring->header->frame_ready);
+		g_thread_join(ring->reader);
+	}
+	if(ring->last != NULL)
+		gst_buffer_unref(ring->last);
+	shm_ring_map_unref(ring->map);
+	if(ring->data != NULL)
+		munmap(ring->data, ring->data_len);
+	if(ring->header != NULL){
+		/* the encode side unlinks each layout once it has it mapped, this is
+		 * for the one it never got to */
+		char data_name[80];
+		shm_ring_data_name(ring, __atomic_load_n(&ring->header->generation, __ATOMIC_ACQUIRE),
+			data_name, sizeof(data_name));
+		shm_unlink(data_name);
+		munmap(ring->header, SHM_RING_HEADER_SIZE);
+	}
+	if(ring->fd >= 0)
+		close(ring->fd);
+	if(ring->owner)
+		shm_unlink(ring->name);
+	g_strfreev(ring->capture_argv);
+	g_free(ring);
+}
+
+static void shm_ring_add_cost(struct shm_ring *ring, int64_t cost){
+	ring->cost_total += cost;
+	ring->cost_count++;
+	if(cost > ring->cost_max)
+		ring->cost_max = cost;
+}
+
+/* Capture side. A new caps or a bigger frame means a new slot layout. The
+ * encode side may still hold frames from the old one, zero copy in buffers
+ * the encoder hasn't let go of, so the old file is left alone and the new
+ * layout goes in a new file. Slots being read stay SLOT_READING until their
+ * buffer is freed and can't be claimed before then. Frames still READY in
+ * the old layout carry the old generation and the encode side drops them. */
+static bool shm_ring_layout(struct shm_ring *ring, GstCaps *caps, size_t size){
+	struct shm_ring_header *hdr = ring->header;
+	gchar *caps_str = gst_caps_to_string(caps);
+	bool same = ring->data != NULL && ring->generation == hdr->generation
+		&& size <= hdr->slot_size && strcmp(caps_str, hdr->caps) == 0;
+	char data_name[80];
+
+	if(same){
+		g_free(caps_str);
+		return true;
+	}
+	if(strlen(caps_str) >= sizeof(hdr->caps)){
+		printf("shm ring caps too long: %s\n", caps_str);
+		g_free(caps_str);
+		return false;
+	}
+	printf("shm ring new layout: %s\n", caps_str);
+
+	if(size < hdr->slot_size)
+		size = hdr->slot_size;
+	size_t data_len = size * hdr->slots;
+	uint32_t old_generation = __atomic_load_n(&hdr->generation, __ATOMIC_ACQUIRE);
+	uint32_t generation = old_generation + 1;
+	shm_ring_data_name(ring, generation, data_name, sizeof(data_name));
+	int fd = shm_open(data_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if(fd < 0){
+		printf("shm_open %s failed: %s\n", data_name, strerror(errno));
+		g_free(caps_str);
+		return false;
+	}
+	uint8_t *data = MAP_FAILED;
+	if(ftruncate(fd, data_len) != 0)
+		printf("shm ring resize failed: %s\n", strerror(errno));
+	else
+		data = mmap(NULL, data_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED){
+		printf("shm ring mmap failed: %s\n", strerror(errno));
+		shm_unlink(data_name);
+		g_free(caps_str);
+		return false;
+	}
+	/* a capture process that died mid frame leaves its slot SLOT_WRITING */
+	for(uint32_t i = 0 ; i < hdr->slots ; i++){
+		uint32_t state = SLOT_WRITING;
+		__atomic_compare_exchange_n(&hdr->slot[i].state, &state, SLOT_FREE,
+			false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+	if(ring->data != NULL)
+		munmap(ring->data, ring->data_len);
+	ring->data = data;
+	ring->data_len = data_len;
+	hdr->slot_size = size;
+	strcpy(hdr->caps, caps_str);
+	g_free(caps_str);
+	__atomic_store_n(&hdr->generation, generation, __ATOMIC_RELEASE);
+	ring->generation = generation;
+
+	/* the encode side unlinks a layout once it maps it, but it may have
+	 * skipped this one. Its mapping keeps the memory as long as needed. */
+	shm_ring_data_name(ring, old_generation, data_name, sizeof(data_name));
+	shm_unlink(data_name);
+	return true;
+}
+
+/* Any slot except the newest one that nobody is reading */
+static int shm_ring_claim(struct shm_ring_header *hdr){
+	uint32_t latest = __atomic_load_n(&hdr->latest, __ATOMIC_ACQUIRE);
+	for(uint32_t i = 1 ; i < hdr->slots ; i++){
+		uint32_t idx = (latest + i) % hdr->slots;
+		uint32_t state = __atomic_load_n(&hdr->slot[idx].state, __ATOMIC_ACQUIRE);
+		if(state != SLOT_FREE && state != SLOT_READY)
+			continue;
+		if(__atomic_compare_exchange_n(&hdr->slot[idx].state, &state, SLOT_WRITING,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return idx;
+	}
+	return -1;
+}
+
+static GstFlowReturn shm_ring_new_sample(GstElement *sink, gpointer data){
+	struct shm_ring *ring = data;
+	struct shm_ring_header *hdr = ring->header;
+	GstSample *sample = NULL;
+	GstMapInfo info;
+
+	g_signal_emit_by_name(sink, "pull-sample", &sample);
+	if(sample == NULL)
+		return GST_FLOW_EOS;
+	GstBuffer *buf = gst_sample_get_buffer(sample);
+	if(!gst_buffer_map(buf, &info, GST_MAP_READ)){
+		gst_sample_unref(sample);
+		return GST_FLOW_ERROR;
+	}
+	if(!shm_ring_layout(ring, gst_sample_get_caps(sample), info.size)){
+		gst_buffer_unmap(buf, &info);
+		gst_sample_unref(sample);
+		return GST_FLOW_ERROR;
+	}
+
+	int64_t start = g_get_monotonic_time();
+	int idx = shm_ring_claim(hdr);
+	if(idx < 0){
+		ring->dropped++;
+	} else {
+		struct shm_slot *slot = &hdr->slot[idx];
+		memcpy(ring->data + idx * hdr->slot_size, info.data, info.size);
+		slot->size = info.size;
+		slot->generation = ring->generation;
+		slot->seq = hdr->write_seq + 1;
+		slot->stamp = start;
+		__atomic_store_n(&slot->state, SLOT_READY, __ATOMIC_RELEASE);
+		__atomic_store_n(&hdr->latest, idx, __ATOMIC_RELEASE);
+		__atomic_store_n(&hdr->write_seq, slot->seq, __ATOMIC_RELEASE);
+		sem_post(&hdr->frame_ready);
+		ring->frames++;
+		shm_ring_add_cost(ring, g_get_monotonic_time() - start);
+	}
+	gst_buffer_unmap(buf, &info);
+	gst_sample_unref(sample);
+	return GST_FLOW_OK;
+}
+
+GstElement * shm_ring_make_sink(struct shm_ring *ring){
+	GstElement *sink = gst_element_factory_make("appsink", "shmsink");
+	g_object_set(G_OBJECT(sink), "emit-signals", TRUE, "sync", FALSE,
+		"max-buffers", 2, "drop", TRUE, NULL);
+	g_signal_connect(sink, "new-sample", G_CALLBACK(shm_ring_new_sample), ring);
+	return sink;
+}
+
+static void shm_ring_release(gpointer data){
+	struct shm_slot_ref *ref = data;
+	/* nobody else touches a slot while it is SLOT_READING */
+	__atomic_store_n(&ref->ring->header->slot[ref->idx].state, SLOT_FREE, __ATOMIC_RELEASE);
+	shm_ring_map_unref(ref->map);
+	g_free(ref);
+}
+
+/* Encode side. Map the new layout and tell appsrc about the new caps. */
+static bool shm_ring_remap(struct shm_ring *ring, uint32_t generation){
+	struct shm_ring_header *hdr = ring->header;
+	char data_name[80];
+	struct stat st;
+
+	/* already replaced by a newer layout if it is gone, that one comes next */
+	shm_ring_data_name(ring, generation, data_name, sizeof(data_name));
+	int fd = shm_open(data_name, O_RDONLY, 0);
+	if(fd < 0)
+		return false;
+	struct shm_ring_map *map = g_new0(struct shm_ring_map, 1);
+	map->base = MAP_FAILED;
+	if(fstat(fd, &st) == 0 && st.st_size > 0){
+		map->len = st.st_size;
+		map->base = mmap(NULL, map->len, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if(map->base == MAP_FAILED){
+		printf("shm ring remap failed: %s\n", strerror(errno));
+		g_free(map);
+		return false;
+	}
+	shm_unlink(data_name);
+	map->slot_size = map->len / hdr->slots;
+	map->refcount = 1;
+	shm_ring_map_unref(ring->map);
+	ring->map = map;
+	if(ring->last != NULL){
+		gst_buffer_unref(ring->last);
+		ring->last = NULL;
+	}
+
+	GstCaps *caps = gst_caps_from_string(hdr->caps);
+	if(caps != NULL){
+		GstStructure *s = gst_caps_get_structure(caps, 0);
+		gint num = 0, den = 0;
+		if(gst_structure_get_fraction(s, "framerate", &num, &den) && num > 0)
+			ring->frame_interval = gst_util_uint64_scale(GST_SECOND, den, num);
+		g_object_set(G_OBJECT(ring->appsrc), "caps", caps, NULL);
+		gst_caps_unref(caps);
+	}
+	printf("shm ring generation %d: %s\n", generation, hdr->caps);
+	ring->generation = generation;
+	return true;
+}
+
+/* Real frames pin a slot so the ring bounds them, but repeats share the last
+ * one and would pile up without limit behind a stalled encoder. */
+static bool shm_ring_backed_up(struct shm_ring *ring){
+	guint64 level = 0;
+	g_object_get(G_OBJECT(ring->appsrc), "current-level-bytes", &level, NULL);
+	return ring->map != NULL && level >= ring->map->slot_size * ring->header->slots;
+}
+
+static void shm_ring_push(struct shm_ring *ring, GstBuffer *buf){
+	GstFlowReturn ret;
+	g_signal_emit_by_name(ring->appsrc, "push-buffer", buf, &ret);
+}
+
+static gpointer shm_ring_reader(gpointer data){
+	struct shm_ring *ring = data;
+	struct shm_ring_header *hdr = ring->header;
+	uint64_t last_seq = 0;
+	bool late = false;
+
+	while(!g_atomic_int_get(&ring->quit)){
+		struct timespec ts;
+		/* wait a bit longer than a frame before deciding the capture side is late,
+		 * on the monotonic clock so setting the wall clock doesn't stall or
+		 * repeat frames (sem_clockwait is glibc 2.30) */
+		GstClockTime wait = late ? ring->frame_interval : ring->frame_interval * 3 / 2;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_nsec += wait % GST_SECOND;
+		ts.tv_sec += wait / GST_SECOND + ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+		if(sem_clockwait(&hdr->frame_ready, CLOCK_MONOTONIC, &ts) != 0){
+			if(errno == ETIMEDOUT && ring->last != NULL && !shm_ring_backed_up(ring)){
+				/* shallow copy, shares the slot memory */
+				GstBuffer *repeat = gst_buffer_copy(ring->last);
+				shm_ring_push(ring, repeat);
+				gst_buffer_unref(repeat);
+				ring->repeated++;
+			}
+			late = true;
+			continue;
+		}
+		late = false;
+		uint64_t seq = __atomic_load_n(&hdr->write_seq, __ATOMIC_ACQUIRE);
+		if(seq == last_seq)
+			continue;
+		uint32_t generation = __atomic_load_n(&hdr->generation, __ATOMIC_ACQUIRE);
+		if(generation != ring->generation && !shm_ring_remap(ring, generation))
+			continue;
+		uint32_t idx = __atomic_load_n(&hdr->latest, __ATOMIC_ACQUIRE);
+		uint32_t state = SLOT_READY;
+		if(!__atomic_compare_exchange_n(&hdr->slot[idx].state, &state, SLOT_READING,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			continue;
+		struct shm_slot *slot = &hdr->slot[idx];
+		if(slot->generation != ring->generation){
+			/* left over from the layout before, its data isn't in our mapping */
+			__atomic_store_n(&slot->state, SLOT_FREE, __ATOMIC_RELEASE);
+			continue;
+		}
+		if(last_seq != 0 && slot->seq > last_seq + 1)
+			ring->dropped += slot->seq - last_seq - 1;
+		last_seq = slot->seq;
+
+		struct shm_slot_ref *ref = g_new0(struct shm_slot_ref, 1);
+		ref->ring = ring;
+		ref->map = ring->map;
+		ref->idx = idx;
+		g_atomic_int_inc(&ring->map->refcount);
+		uint8_t *frame = ring->map->base + idx * ring->map->slot_size;
+		GstBuffer *buf = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, frame,
+			slot->size, 0, slot->size, ref, shm_ring_release);
+
+		shm_ring_add_cost(ring, g_get_monotonic_time() - slot->stamp);
+		shm_ring_push(ring, buf);
+		ring->frames++;
+		if(ring->last != NULL)
+			gst_buffer_unref(ring->last);
+		ring->last = buf;
+	}
+	return NULL;
+}
+
+GstElement * shm_ring_make_src(struct shm_ring *ring){
+	GstElement *src = gst_element_factory_make("appsrc", "shmsrc");
+	/* every queued frame pins a slot, so the ring itself bounds this queue,
+	 * and shm_ring_backed_up keeps repeats from growing it */
+	g_object_set(G_OBJECT(src), "is-live", TRUE, "do-timestamp", TRUE,
+		"format", GST_FORMAT_TIME, "max-bytes", (guint64) 0, NULL);
+	ring->appsrc = src;
+	ring->reader = g_thread_new("shmreader", shm_ring_reader, ring);
+	return src;
+}
+
+static gboolean shm_ring_respawn(gpointer data);
+
+static void shm_ring_capture_exited(GPid pid, gint status, gpointer data){
+	struct shm_ring *ring = data;
+	g_spawn_close_pid(pid);
+	ring->capture_pid = 0;
+	if(ring->capture_argv == NULL)
+		return;
+	printf("capture process %d exited with status %d, restarting\n", pid, status);
+	ring->restarts++;
+	g_timeout_add(500, shm_ring_respawn, ring);
+}
+
+/* don't leave an orphaned capture process behind if the encode process dies */
+static void shm_ring_child_setup(gpointer data){
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+}
+
+static gboolean shm_ring_respawn(gpointer data){
+	struct shm_ring *ring = data;
+	GError *err = NULL;
+	if(ring->capture_argv == NULL)
+		return FALSE;
+	if(!g_spawn_async(NULL, ring->capture_argv, NULL,
+			G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH, shm_ring_child_setup, NULL,
+			&ring->capture_pid, &err)){
+		printf("could not start capture process: %s\n", err->message);
+		g_error_free(err);
+		return TRUE; // keep trying
+	}
+	printf("capture process pid %d\n", ring->capture_pid);
+	g_child_watch_add(ring->capture_pid, shm_ring_capture_exited, ring);
+	return FALSE;
+}
+
+bool shm_ring_spawn_capture(struct shm_ring *ring, char **argv){
+	ring->capture_argv = g_strdupv(argv);
+	shm_ring_respawn(ring);
+	return ring->capture_pid != 0;
+}
+
+void shm_ring_stop_capture(struct shm_ring *ring){
+	g_strfreev(ring->capture_argv);
+	ring->capture_argv = NULL;
+	if(ring->capture_pid != 0)
+		kill(ring->capture_pid, SIGTERM);
+}
+
+gboolean shm_ring_print_stats(gpointer data){
+	struct shm_ring *ring = data;
+	double avg = ring->cost_count > 0 ? (double) ring->cost_total / ring->cost_count : 0;
+	printf("shm %s: frames %" G_GUINT64_FORMAT " dropped %" G_GUINT64_FORMAT
+		" repeated %" G_GUINT64_FORMAT " restarts %" G_GUINT64_FORMAT
+		" %s avg %.0f us max %" G_GINT64_FORMAT " us\n",
+		ring->owner ? "encode" : "capture",
+		ring->frames, ring->dropped, ring->repeated, ring->restarts,
+		ring->owner ? "handoff latency" : "copy", avg, ring->cost_max);
+	ring->cost_total = 0;
+	ring->cost_count = 0;
+	ring->cost_max = 0;
+	return TRUE;
+}
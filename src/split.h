@@ -0,0 +1,54 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITCORDER_SPLIT_H
+#define BITCORDER_SPLIT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gst/gst.h>
+
+/* Two process mode. The capture process composites and hands finished
+ * frames to the encode process through a ring of slots in shared memory.
+ * The encode process owns the ring, the audio, the encoder and all of the
+ * outputs, and restarts the capture process if it dies. */
+
+#define SHM_RING_MAX_SLOTS 8
+#define SHM_RING_DEFAULT_SLOTS 4
+
+struct shm_ring;
+
+/* encode side, creates the shared memory */
+struct shm_ring * shm_ring_create(const char *name, uint32_t slots);
+/* capture side, attaches to a ring the encode process already created */
+struct shm_ring * shm_ring_attach(const char *name);
+void shm_ring_destroy(struct shm_ring *ring);
+
+/* appsink that copies each frame into the ring */
+GstElement * shm_ring_make_sink(struct shm_ring *ring);
+/* appsrc fed from the ring without copying, repeats the last frame while
+ * the capture process is gone so the outputs keep going */
+GstElement * shm_ring_make_src(struct shm_ring *ring);
+
+/* run argv as the capture process, respawning it whenever it exits */
+bool shm_ring_spawn_capture(struct shm_ring *ring, char **argv);
+void shm_ring_stop_capture(struct shm_ring *ring);
+
+/* g_timeout_add callback, prints handoff cost and drop counts */
+gboolean shm_ring_print_stats(gpointer data);
+
+#endif
@@ -0,0 +1,89 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include "startup.h"
+
+#define MAX_PARALLEL 8
+
+static int64_t startup_time = 0;
+
+void startup_begin(void){
+	startup_time = g_get_monotonic_time();
+}
+
+void startup_mark(const char *what){
+	printf("startup: %s at %.1f ms\n", what, (g_get_monotonic_time() - startup_time) / 1000.0);
+}
+
+static GstPadProbeReturn startup_first_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	startup_mark(data);
+	return GST_PAD_PROBE_REMOVE;
+}
+
+void startup_watch_first(GstPad *pad, const char *what){
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+		(GstPadProbeCallback) startup_first_probe, (gpointer) what, NULL);
+}
+
+static gpointer startup_ready_thread(gpointer data){
+	GstElement *element = data;
+	gchar *name = gst_element_get_name(element);
+	if(gst_element_set_state(element, GST_STATE_READY) == GST_STATE_CHANGE_FAILURE)
+		printf("startup: %s failed to get ready\n", name);
+	else
+		startup_mark(name);
+	g_free(name);
+	return NULL;
+}
+
+/* Opening the encoder and setting up the outputs doesn't depend on the
+ * capture and GL elements, so they can all open at once. The GL elements
+ * stay together in this thread since they have to agree on one display. */
+void startup_ready_parallel(GstElement *pipeline, GstElement **elements, int count){
+	GThread *threads[MAX_PARALLEL];
+	int started = 0;
+	for(int i = 0 ; i < count && started < MAX_PARALLEL ; i++){
+		if(elements[i] == NULL)
+			continue;
+		threads[started++] = g_thread_new("startup", startup_ready_thread, elements[i]);
+	}
+	/* The pipeline itself would go sinks first and wait on the threads,
+	 * so bring everyone else up directly. NULL to READY doesn't move any
+	 * data, order doesn't matter. */
+	GstIterator *it = gst_bin_iterate_elements(GST_BIN(pipeline));
+	GValue item = G_VALUE_INIT;
+	while(gst_iterator_next(it, &item) == GST_ITERATOR_OK){
+		GstElement *element = g_value_get_object(&item);
+		bool threaded = false;
+		for(int i = 0 ; i < count ; i++)
+			if(elements[i] == element)
+				threaded = true;
+		if(!threaded)
+			gst_element_set_state(element, GST_STATE_READY);
+		g_value_reset(&item);
+	}
+	g_value_unset(&item);
+	gst_iterator_free(it);
+	startup_mark("capture and compositing ready");
+	for(int i = 0 ; i < started ; i++)
+		g_thread_join(threads[i]);
+	gst_element_set_state(pipeline, GST_STATE_READY);
+	startup_mark("pipeline ready");
+}
@@ -0,0 +1,39 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITCORDER_STARTUP_H
+#define BITCORDER_STARTUP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gst/gst.h>
+
+/* Startup timing. Every step prints how long after the start of main it
+ * finished, ending with the first composited frame and the first packet
+ * out of each output. Restarting after a crash is dead air on stream,
+ * so this is what to look at when it takes too long. */
+
+/* first thing in main */
+void startup_begin(void);
+void startup_mark(const char *what);
+/* marks what when the first buffer goes through pad */
+void startup_watch_first(GstPad *pad, const char *what);
+/* takes each element to READY in its own thread while this thread takes
+ * the rest of the pipeline there */
+void startup_ready_parallel(GstElement *pipeline, GstElement **elements, int count);
+
+#endif
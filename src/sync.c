@@ -0,0 +1,201 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include "sync.h"
+
+/* one muxer input */
+struct sync_input {
+	struct sync_monitor *monitor;
+	GstSegment segment;
+	bool have_segment;
+	int64_t min_lag;	// smallest lag this period, queueing only adds to it
+	uint32_t buffers;
+};
+
+struct sync_monitor {
+	char name[32];
+	GstElement *pipeline;
+	GMutex lock;
+	struct sync_input audio;
+	struct sync_input video;
+	bool have_baseline;
+	int64_t baseline;	// skew in the first full period
+	int64_t skew;
+	int64_t drift;
+	// correction
+	bool correcting;
+	uint32_t slew;
+	GstSegment corr_segment;
+	int64_t target;		// how much more video should lag
+	int64_t applied;
+	GstClockTime last_pts;
+};
+
+static void sync_input_reset(struct sync_input *input){
+	input->min_lag = G_MAXINT64;
+	input->buffers = 0;
+}
+
+static GstPadProbeReturn sync_input_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct sync_input *input = data;
+	struct sync_monitor *monitor = input->monitor;
+
+	if(info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM){
+		GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+		if(GST_EVENT_TYPE(event) == GST_EVENT_SEGMENT){
+			g_mutex_lock(&monitor->lock);
+			gst_event_copy_segment(event, &input->segment);
+			input->have_segment = input->segment.format == GST_FORMAT_TIME;
+			g_mutex_unlock(&monitor->lock);
+		}
+		return GST_PAD_PROBE_OK;
+	}
+
+	GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+	GstClock *clock = gst_element_get_clock(monitor->pipeline);
+	if(clock == NULL || !input->have_segment || !GST_BUFFER_PTS_IS_VALID(buf)){
+		if(clock != NULL)
+			gst_object_unref(clock);
+		return GST_PAD_PROBE_OK;
+	}
+	GstClockTime now = gst_clock_get_time(clock) - gst_element_get_base_time(monitor->pipeline);
+	gst_object_unref(clock);
+
+	g_mutex_lock(&monitor->lock);
+	GstClockTime running = gst_segment_to_running_time(&input->segment, GST_FORMAT_TIME, GST_BUFFER_PTS(buf));
+	if(GST_CLOCK_TIME_IS_VALID(running)){
+		int64_t lag = (int64_t) now - (int64_t) running;
+		if(lag < input->min_lag)
+			input->min_lag = lag;
+		input->buffers++;
+	}
+	g_mutex_unlock(&monitor->lock);
+	return GST_PAD_PROBE_OK;
+}
+
+static void sync_input_watch(struct sync_monitor *monitor, struct sync_input *input, GstPad *pad){
+	input->monitor = monitor;
+	gst_segment_init(&input->segment, GST_FORMAT_TIME);
+	sync_input_reset(input);
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+		(GstPadProbeCallback) sync_input_probe, input, NULL);
+}
+
+struct sync_monitor * sync_monitor_new(const char *name, GstElement *pipeline,
+		GstPad *audiopad, GstPad *videopad){
+	struct sync_monitor *monitor = g_new0(struct sync_monitor, 1);
+	snprintf(monitor->name, sizeof(monitor->name), "%s", name);
+	monitor->pipeline = pipeline;
+	g_mutex_init(&monitor->lock);
+	sync_input_watch(monitor, &monitor->audio, audiopad);
+	sync_input_watch(monitor, &monitor->video, videopad);
+	return monitor;
+}
+
+/* Moves applied toward target a little on every frame. Video timestamps
+ * only change in tiny steps, the frames themselves are all kept. */
+static GstPadProbeReturn sync_correct_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	struct sync_monitor *monitor = data;
+
+	if(info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM){
+		GstEvent *event = GST_PAD_PROBE_INFO_EVENT(info);
+		if(GST_EVENT_TYPE(event) == GST_EVENT_SEGMENT)
+			gst_event_copy_segment(event, &monitor->corr_segment);
+		return GST_PAD_PROBE_OK;
+	}
+
+	GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+	if(!GST_BUFFER_PTS_IS_VALID(buf))
+		return GST_PAD_PROBE_OK;
+
+	g_mutex_lock(&monitor->lock);
+	GstClockTime pts = GST_BUFFER_PTS(buf);
+	if(GST_CLOCK_TIME_IS_VALID(monitor->last_pts) && pts > monitor->last_pts){
+		int64_t step = gst_util_uint64_scale(pts - monitor->last_pts, monitor->slew * GST_USECOND, GST_SECOND);
+		int64_t diff = monitor->target - monitor->applied;
+		if(diff > step)
+			diff = step;
+		else if(diff < -step)
+			diff = -step;
+		monitor->applied += diff;
+	}
+	monitor->last_pts = pts;
+	int64_t applied = monitor->applied;
+	g_mutex_unlock(&monitor->lock);
+
+	if(applied == 0)
+		return GST_PAD_PROBE_OK;
+	/* earlier timestamps make video lag more, they never go below the segment start */
+	buf = gst_buffer_make_writable(buf);
+	int64_t shifted = (int64_t) pts - applied;
+	if(shifted < (int64_t) monitor->corr_segment.start)
+		shifted = monitor->corr_segment.start;
+	if(GST_BUFFER_DTS_IS_VALID(buf)){
+		int64_t dts = (int64_t) GST_BUFFER_DTS(buf) - applied;
+		GST_BUFFER_DTS(buf) = dts < 0 ? 0 : dts;
+	}
+	GST_BUFFER_PTS(buf) = shifted;
+	GST_PAD_PROBE_INFO_DATA(info) = buf;
+	return GST_PAD_PROBE_OK;
+}
+
+void sync_monitor_correct(struct sync_monitor *monitor, GstPad *pad, uint32_t slew){
+	monitor->correcting = true;
+	monitor->slew = slew > 0 ? slew : SYNC_DEFAULT_SLEW;
+	monitor->last_pts = GST_CLOCK_TIME_NONE;
+	gst_segment_init(&monitor->corr_segment, GST_FORMAT_TIME);
+	printf("%s: correcting a/v drift, at most %u us/s\n", monitor->name, monitor->slew);
+	gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+		(GstPadProbeCallback) sync_correct_probe, monitor, NULL);
+}
+
+gboolean sync_monitor_print_stats(gpointer data){
+	struct sync_monitor *monitor = data;
+	g_mutex_lock(&monitor->lock);
+	if(monitor->audio.buffers == 0 || monitor->video.buffers == 0){
+		g_mutex_unlock(&monitor->lock);
+		printf("%s: a/v sync waiting for audio %u video %u\n", monitor->name,
+			monitor->audio.buffers, monitor->video.buffers);
+		return TRUE;
+	}
+	/* positive skew is audio further behind the clock than video. The
+	 * correction is already in the video lag, add it back to get the
+	 * drift of the sources. Monitors on other muxers see the residual. */
+	monitor->skew = monitor->audio.min_lag - monitor->video.min_lag;
+	int64_t raw_skew = monitor->skew + monitor->applied;
+	if(!monitor->have_baseline){
+		monitor->baseline = raw_skew;
+		monitor->have_baseline = true;
+	}
+	monitor->drift = raw_skew - monitor->baseline;
+	if(monitor->correcting)
+		monitor->target = monitor->drift;
+	int64_t skew = monitor->skew, drift = monitor->drift, applied = monitor->applied;
+	sync_input_reset(&monitor->audio);
+	sync_input_reset(&monitor->video);
+	g_mutex_unlock(&monitor->lock);
+
+	printf("%s: a/v skew %.1f ms drift %.1f ms", monitor->name,
+		(double) skew / GST_MSECOND, (double) drift / GST_MSECOND);
+	if(monitor->correcting)
+		printf(" correction %.1f ms", (double) applied / GST_MSECOND);
+	printf("\n");
+	return TRUE;
+}
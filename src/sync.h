@@ -0,0 +1,45 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITCORDER_SYNC_H
+#define BITCORDER_SYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gst/gst.h>
+
+/* Audio/video sync watch at a muxer. For every buffer going into the
+ * muxer the lag is how far its timestamp is behind the pipeline clock when
+ * it gets there. Encoding makes video lag more than audio, but that
+ * difference should stay put. When it moves, the audio device clock and
+ * the capture timestamps are drifting apart. */
+
+#define SYNC_DEFAULT_SLEW 1000		// microseconds of correction per second
+
+struct sync_monitor;
+
+struct sync_monitor * sync_monitor_new(const char *name, GstElement *pipeline,
+	GstPad *audiopad, GstPad *videopad);
+/* Shift video timestamps on pad to follow the drift measured by monitor.
+ * The shift changes by at most slew microseconds per second of video, so
+ * no frames are dropped or repeated. */
+void sync_monitor_correct(struct sync_monitor *monitor, GstPad *pad, uint32_t slew);
+
+/* g_timeout_add callback, prints skew, drift and correction */
+gboolean sync_monitor_print_stats(gpointer data);
+
+#endif
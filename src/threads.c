@@ -0,0 +1,325 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <gst/gl/gl.h>
+#include "threads.h"
+
+char * thread_class_names[] = {
+	[THREAD_CAPTURE] = "capture",
+	[THREAD_GL] = "gl",
+	[THREAD_ENCODE] = "encode",
+	[THREAD_IO] = "io",
+	[THREAD_AUDIO] = "audio",
+	[THREAD_OTHER] = "other",
+	[INVALID_THREAD_CLASS] = "invalid_class"
+};
+
+char * thread_sched_names[] = {
+	[SCHED_DEFAULT] = "default",
+	[SCHED_NICE] = "nice",
+	[SCHED_FIFO_RT] = "fifo",
+	[SCHED_RR_RT] = "rr"
+};
+
+#define MAX_THREADS 128
+
+struct thread_entry {
+	pid_t tid;
+	enum thread_class class;
+	uint64_t last_run;	// ns on cpu, from schedstat
+	uint64_t last_wait;	// ns runnable but waiting for a cpu
+	uint64_t last_slices;
+};
+
+static struct thread_policy *thread_policy = NULL;
+static GMutex thread_lock;
+static struct thread_entry threads[MAX_THREADS];
+static int thread_count = 0;
+static int64_t thread_last_stats = 0;
+
+bool thread_parse_cpus(const char *value, uint64_t *cpus){
+	char *end;
+	*cpus = 0;
+	while(*value != '\0'){
+		long first = strtol(value, &end, 0);
+		long last = first;
+		if(end == value)
+			return false;
+		if(*end == '-'){
+			value = end + 1;
+			last = strtol(value, &end, 0);
+			if(end == value)
+				return false;
+		}
+		if(first < 0 || last >= MAX_THREAD_CPUS || last < first)
+			return false;
+		for(long cpu = first ; cpu <= last ; cpu++)
+			*cpus |= (uint64_t) 1 << cpu;
+		value = end;
+		if(*value == ':')
+			value++;
+		else if(*value != '\0')
+			return false;
+	}
+	return *cpus != 0;
+}
+
+/* What a thread does is decided by the first element it runs that says
+ * something about it, looking downstream from the pad that owns it. */
+static enum thread_class thread_class_of_element(GstElement *element){
+	GstElementFactory *factory = gst_element_get_factory(element);
+	if(factory == NULL)
+		return INVALID_THREAD_CLASS;
+	const gchar *name = gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory));
+	const gchar *klass = gst_element_factory_get_metadata(factory, GST_ELEMENT_METADATA_KLASS);
+	if(klass == NULL)
+		klass = "";
+	if(strstr(klass, "Audio") != NULL || strcmp(name, "audiomixer") == 0)
+		return THREAD_AUDIO;
+	if(strstr(klass, "Network") != NULL)
+		return THREAD_IO; // nicesrc is a source but not a capture
+	if(strstr(klass, "Source") != NULL)
+		return THREAD_CAPTURE;
+	if(g_str_has_prefix(name, "gl"))
+		return THREAD_GL;
+	if(strstr(klass, "Encoder") != NULL || strstr(klass, "Decoder") != NULL)
+		return THREAD_ENCODE; // media layers decode on the encode cpus
+	if(strstr(klass, "Sink") != NULL && strstr(klass, "Video") != NULL)
+		return THREAD_OTHER; // preview
+	if(strstr(klass, "Muxer") != NULL || strstr(klass, "Sink") != NULL || strstr(klass, "Payloader") != NULL)
+		return THREAD_IO;
+	return INVALID_THREAD_CLASS;
+}
+
+static enum thread_class thread_classify(GstElement *owner){
+	enum thread_class class = thread_class_of_element(owner);
+	GstElement *element = gst_object_ref(owner);
+	for(int hops = 0 ; class == INVALID_THREAD_CLASS && hops < 8 ; hops++){
+		GstPad *srcpad = NULL;
+		GstIterator *it = gst_element_iterate_src_pads(element);
+		GValue item = G_VALUE_INIT;
+		if(gst_iterator_next(it, &item) == GST_ITERATOR_OK){
+			srcpad = g_value_dup_object(&item);
+			g_value_reset(&item);
+		}
+		gst_iterator_free(it);
+		gst_object_unref(element);
+		element = NULL;
+		if(srcpad == NULL)
+			break;
+		GstPad *peer = gst_pad_get_peer(srcpad);
+		gst_object_unref(srcpad);
+		if(peer == NULL)
+			break;
+		/* ghost pads lead into bins, find the element behind them */
+		while(GST_IS_GHOST_PAD(peer)){
+			GstPad *target = gst_ghost_pad_get_target(GST_GHOST_PAD(peer));
+			gst_object_unref(peer);
+			peer = target;
+			if(peer == NULL)
+				break;
+		}
+		if(peer == NULL)
+			break;
+		element = gst_pad_get_parent_element(peer);
+		gst_object_unref(peer);
+		if(element == NULL)
+			break;
+		/* the next queue starts somebody else's thread */
+		GstElementFactory *factory = gst_element_get_factory(element);
+		if(factory != NULL && g_str_has_suffix(gst_plugin_feature_get_name(GST_PLUGIN_FEATURE(factory)), "queue"))
+			break;
+		class = thread_class_of_element(element);
+	}
+	if(element != NULL)
+		gst_object_unref(element);
+	return class == INVALID_THREAD_CLASS ? THREAD_OTHER : class;
+}
+
+static void thread_apply_policy(pid_t tid, enum thread_class class, const char *name){
+	struct thread_policy *policy = &thread_policy[class];
+	if(policy->use_cpus){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for(int cpu = 0 ; cpu < MAX_THREAD_CPUS ; cpu++)
+			if(policy->cpus & ((uint64_t) 1 << cpu))
+				CPU_SET(cpu, &set);
+		if(sched_setaffinity(0, sizeof(set), &set) != 0)
+			printf("thread %s: affinity failed: %s\n", name, strerror(errno));
+	}
+	struct sched_param param = { 0 };
+	switch(policy->sched){
+		case SCHED_NICE:
+			if(setpriority(PRIO_PROCESS, tid, policy->nice) != 0)
+				printf("thread %s: nice %d failed: %s\n", name, policy->nice, strerror(errno));
+			break;
+		case SCHED_FIFO_RT:
+		case SCHED_RR_RT:
+			param.sched_priority = policy->priority;
+			errno = pthread_setschedparam(pthread_self(),
+				policy->sched == SCHED_FIFO_RT ? SCHED_FIFO : SCHED_RR, &param);
+			if(errno != 0)
+				printf("thread %s: %s %d failed: %s, needs rtprio or CAP_SYS_NICE\n", name,
+					thread_sched_names[policy->sched], policy->priority, strerror(errno));
+			break;
+		default:
+			break;
+	}
+}
+
+/* names the calling thread, applies its policy and counts it in the stats */
+static void thread_register(enum thread_class class, const gchar *element_name){
+	pid_t tid = syscall(SYS_gettid);
+	char name[16];
+	snprintf(name, sizeof(name), "%.3s:%s", thread_class_names[class], element_name);
+	pthread_setname_np(pthread_self(), name);
+	thread_apply_policy(tid, class, name);
+	printf("thread %d %s is %s\n", tid, name, thread_class_names[class]);
+
+	g_mutex_lock(&thread_lock);
+	if(thread_count < MAX_THREADS){
+		struct thread_entry *entry = &threads[thread_count++];
+		memset(entry, 0, sizeof(*entry));
+		entry->tid = tid;
+		entry->class = class;
+	}
+	g_mutex_unlock(&thread_lock);
+}
+
+static GstBusSyncReply thread_sync_handler(GstBus *bus, GstMessage *message, gpointer data){
+	if(GST_MESSAGE_TYPE(message) != GST_MESSAGE_STREAM_STATUS)
+		return GST_BUS_PASS;
+	GstStreamStatusType type;
+	GstElement *owner;
+	gst_message_parse_stream_status(message, &type, &owner);
+	if(type != GST_STREAM_STATUS_TYPE_ENTER || owner == NULL)
+		return GST_BUS_PASS;
+
+	/* posted from the new thread itself, so everything here is for this thread */
+	gchar *element_name = gst_element_get_name(owner);
+	thread_register(thread_classify(owner), element_name);
+	g_free(element_name);
+	return GST_BUS_PASS;
+}
+
+static void thread_gl_enter(GstGLContext *context, gpointer data){
+	thread_register(THREAD_GL, "context");
+}
+
+/* The context is made during negotiation, by the first buffer it is there */
+static GstPadProbeReturn thread_gl_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data){
+	GstGLContext *context = NULL;
+	if(thread_policy == NULL)
+		return GST_PAD_PROBE_REMOVE;
+	g_object_get(G_OBJECT(GST_PAD_PARENT(pad)), "context", &context, NULL);
+	if(context == NULL)
+		return GST_PAD_PROBE_OK;
+	/* runs on the GL thread and waits for it */
+	gst_gl_context_thread_add(context, thread_gl_enter, NULL);
+	gst_object_unref(context);
+	return GST_PAD_PROBE_REMOVE;
+}
+
+void thread_policy_add_gl(GstElement *element){
+	GstPad *src = gst_element_get_static_pad(element, "src");
+	gst_pad_add_probe(src, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback) thread_gl_probe, NULL, NULL);
+	gst_object_unref(src);
+}
+
+void thread_policy_install(GstElement *pipeline, struct thread_policy *policy){
+	thread_policy = policy;
+	g_mutex_init(&thread_lock);
+	thread_policy_add_pipeline(pipeline);
+}
+
+void thread_policy_add_pipeline(GstElement *pipeline){
+	GstBus *bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
+	gst_bus_set_sync_handler(bus, thread_sync_handler, NULL, NULL);
+	gst_object_unref(bus);
+}
+
+/* schedstat is time on cpu, time waiting on a run queue, and timeslices */
+static bool thread_read_schedstat(pid_t tid, uint64_t *run, uint64_t *wait, uint64_t *slices){
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/task/%d/schedstat", tid);
+	FILE *file = fopen(path, "r");
+	if(file == NULL)
+		return false;
+	unsigned long long r, w, s;
+	int found = fscanf(file, "%llu %llu %llu", &r, &w, &s);
+	fclose(file);
+	if(found != 3)
+		return false;
+	*run = r;
+	*wait = w;
+	*slices = s;
+	return true;
+}
+
+gboolean thread_print_stats(gpointer data){
+	uint64_t run[INVALID_THREAD_CLASS] = { 0 };
+	uint64_t wait[INVALID_THREAD_CLASS] = { 0 };
+	uint64_t slices[INVALID_THREAD_CLASS] = { 0 };
+	int count[INVALID_THREAD_CLASS] = { 0 };
+	int64_t now = g_get_monotonic_time();
+	int64_t elapsed = now - thread_last_stats;
+
+	g_mutex_lock(&thread_lock);
+	for(int i = 0 ; i < thread_count ; i++){
+		struct thread_entry *entry = &threads[i];
+		uint64_t r, w, s;
+		if(!thread_read_schedstat(entry->tid, &r, &w, &s))
+			continue; // thread is gone
+		/* new threads only get their starting counts */
+		if(entry->last_slices != 0){
+			run[entry->class] += r - entry->last_run;
+			wait[entry->class] += w - entry->last_wait;
+			slices[entry->class] += s - entry->last_slices;
+		}
+		count[entry->class]++;
+		entry->last_run = r;
+		entry->last_wait = w;
+		entry->last_slices = s;
+	}
+	g_mutex_unlock(&thread_lock);
+
+	/* the first call only sets the starting counts */
+	if(thread_last_stats != 0){
+		for(int class = 0 ; class < INVALID_THREAD_CLASS ; class++){
+			if(count[class] == 0)
+				continue;
+			printf("threads %s: %d cpu %.1f%% run queue wait %.3f ms avg %.1f ms total\n",
+				thread_class_names[class], count[class],
+				100.0 * run[class] / 1000 / elapsed,
+				slices[class] > 0 ? (double) wait[class] / slices[class] / 1000000 : 0.0,
+				(double) wait[class] / 1000000);
+		}
+	}
+	thread_last_stats = now;
+	return TRUE;
+}
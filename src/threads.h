@@ -0,0 +1,64 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITCORDER_THREADS_H
+#define BITCORDER_THREADS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gst/gst.h>
+
+/* Streaming thread policy. Every streaming thread tells the bus when it
+ * starts, from inside the new thread. That is where it gets a name, a
+ * class from what it runs, and the class's CPUs and scheduling. The GL
+ * thread belongs to a GL context instead and never tells the bus, so it is
+ * reached through the context. */
+
+enum thread_class { THREAD_CAPTURE = 0, THREAD_GL, THREAD_ENCODE, THREAD_IO, THREAD_AUDIO,
+	THREAD_OTHER, INVALID_THREAD_CLASS };
+extern char * thread_class_names[];
+
+enum thread_sched { SCHED_DEFAULT = 0, SCHED_NICE, SCHED_FIFO_RT, SCHED_RR_RT };
+extern char * thread_sched_names[];
+
+#define MAX_THREAD_CPUS 64
+
+struct thread_policy {
+	bool use_cpus;
+	uint64_t cpus;		// bit mask
+	enum thread_sched sched;
+	int nice;
+	int priority;		// for fifo and rr
+};
+
+/* cpus like 2-3 or 0:2:4, false if it makes no sense */
+bool thread_parse_cpus(const char *value, uint64_t *cpus);
+
+/* watches pipeline's bus, policy is indexed by enum thread_class. This is
+ * the bus's sync handler, and a bus only has one, so nothing else may set
+ * one on these pipelines. */
+void thread_policy_install(GstElement *pipeline, struct thread_policy *policy);
+/* same policy for the threads of another pipeline, after install */
+void thread_policy_add_pipeline(GstElement *pipeline);
+/* gl policy for the thread of the GL context that element gets, element
+ * is a GL element with a context property like the mixer */
+void thread_policy_add_gl(GstElement *element);
+
+/* g_timeout_add callback, prints cpu use and run queue wait per class */
+gboolean thread_print_stats(gpointer data);
+
+#endif
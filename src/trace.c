@@ -0,0 +1,289 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <gst/gst.h>
+#include <glib-unix.h>
+#include "trace.h"
+
+enum trace_phase { TRACE_BEGIN = 'B', TRACE_END = 'E' };
+
+/* A seqlock per slot. The writer marks the slot invalid, fills it in and
+ * writes seq last. A reader only trusts a copy if seq was the index it
+ * expects both before and after copying, otherwise a writer lapped it. */
+struct trace_event {
+	uint64_t seq;
+	uint64_t ts;		// ns since gst_init
+	uint64_t pts;
+	int32_t tid;
+	char phase;
+	char name[23];
+};
+
+struct trace_state {
+	FILE *file;
+	char *filename;
+	uint32_t ring;
+	uint64_t size;		// events in the ring
+	uint64_t head;		// next slot to claim
+	uint64_t tail;		// next slot to write out
+	uint64_t lost;
+	uint32_t dumps;		// ring mode, numbers the files
+	bool first_event;
+	GHashTable *tids;	// threads already named in the file
+	struct trace_event *events;
+	GstTracer *tracer;
+};
+
+static struct trace_state trace;
+
+/* Minimal tracer, all it does is register the hooks */
+typedef struct { GstTracer parent; } BitcorderTracer;
+typedef struct { GstTracerClass parent_class; } BitcorderTracerClass;
+GType bitcorder_tracer_get_type(void);
+G_DEFINE_TYPE(BitcorderTracer, bitcorder_tracer, GST_TYPE_TRACER);
+
+/* two hooks per buffer per pad, so not a syscall each time */
+static __thread int32_t trace_tid = 0;
+
+static void trace_record(GstClockTime ts, char phase, GstPad *pad, GstBuffer *buffer){
+	uint64_t idx = __atomic_fetch_add(&trace.head, 1, __ATOMIC_RELAXED);
+	struct trace_event *ev = &trace.events[idx % trace.size];
+	__atomic_store_n(&ev->seq, G_MAXUINT64, __ATOMIC_RELAXED);
+	/* nobody sees the new fields before the slot is marked invalid */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	ev->ts = ts;
+	if(trace_tid == 0)
+		trace_tid = syscall(SYS_gettid);
+	ev->tid = trace_tid;
+	ev->phase = phase;
+	ev->pts = buffer != NULL ? GST_BUFFER_PTS(buffer) : GST_CLOCK_TIME_NONE;
+	if(phase == TRACE_BEGIN){
+		/* the element the buffer is going into */
+		GstPad *peer = GST_PAD_PEER(pad);
+		GstObject *parent = peer != NULL ? GST_OBJECT_PARENT(peer) : NULL;
+		snprintf(ev->name, sizeof(ev->name), "%s", parent != NULL ? GST_OBJECT_NAME(parent) : "?");
+	}
+	__atomic_store_n(&ev->seq, idx, __ATOMIC_RELEASE);
+}
+
+static void trace_push_pre(GObject *self, GstClockTime ts, GstPad *pad, GstBuffer *buffer){
+	trace_record(ts, TRACE_BEGIN, pad, buffer);
+}
+
+static void trace_push_list_pre(GObject *self, GstClockTime ts, GstPad *pad, GstBufferList *list){
+	trace_record(ts, TRACE_BEGIN, pad, gst_buffer_list_length(list) > 0 ? gst_buffer_list_get(list, 0) : NULL);
+}
+
+static void trace_push_post(GObject *self, GstClockTime ts, GstPad *pad, GstFlowReturn res){
+	trace_record(ts, TRACE_END, pad, NULL);
+}
+
+static void bitcorder_tracer_class_init(BitcorderTracerClass *klass){
+}
+
+static void bitcorder_tracer_init(BitcorderTracer *self){
+	GstTracer *tracer = GST_TRACER(self);
+	gst_tracing_register_hook(tracer, "pad-push-pre", G_CALLBACK(trace_push_pre));
+	gst_tracing_register_hook(tracer, "pad-push-post", G_CALLBACK(trace_push_post));
+	gst_tracing_register_hook(tracer, "pad-push-list-pre", G_CALLBACK(trace_push_list_pre));
+	gst_tracing_register_hook(tracer, "pad-push-list-post", G_CALLBACK(trace_push_post));
+}
+
+static void trace_write_thread_name(int32_t tid){
+	if(g_hash_table_contains(trace.tids, GINT_TO_POINTER(tid)))
+		return;
+	g_hash_table_add(trace.tids, GINT_TO_POINTER(tid));
+	char path[64];
+	char name[32] = "";
+	snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+	FILE *comm = fopen(path, "r");
+	if(comm != NULL){
+		if(fgets(name, sizeof(name), comm) != NULL)
+			name[strcspn(name, "\n")] = '\0';
+		fclose(comm);
+	}
+	fprintf(trace.file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+		"\"args\":{\"name\":\"%s\"}}", trace.first_event ? "" : ",\n", getpid(), tid, name);
+	trace.first_event = false;
+}
+
+static void trace_write_event(struct trace_event *ev){
+	trace_write_thread_name(ev->tid);
+	if(ev->phase == TRACE_BEGIN){
+		fprintf(trace.file, ",\n{\"name\":\"%s\",\"cat\":\"buffer\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+			ev->name, ev->ts / 1000.0, getpid(), ev->tid);
+		if(GST_CLOCK_TIME_IS_VALID(ev->pts))
+			fprintf(trace.file, ",\"args\":{\"pts\":%.3f}", ev->pts / 1000000.0);
+		fprintf(trace.file, "}");
+	} else {
+		fprintf(trace.file, ",\n{\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+			ev->ts / 1000.0, getpid(), ev->tid);
+	}
+}
+
+/* copy of slot idx, false if it is being written or was lapped */
+static bool trace_read(uint64_t idx, struct trace_event *copy){
+	struct trace_event *ev = &trace.events[idx % trace.size];
+	if(__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != idx)
+		return false;
+	*copy = *ev;
+	/* the copy is done before seq is looked at again */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&ev->seq, __ATOMIC_RELAXED) == idx;
+}
+
+/* writes slots from tail up to what writers have finished, skipping
+ * anything older than oldest. Returns the time of the first one written. */
+static uint64_t trace_drain(uint64_t oldest){
+	uint64_t first = G_MAXUINT64;
+	uint64_t head = __atomic_load_n(&trace.head, __ATOMIC_ACQUIRE);
+	if(head - trace.tail > trace.size){
+		trace.lost += head - trace.tail - trace.size;
+		trace.tail = head - trace.size;
+	}
+	for( ; trace.tail < head ; trace.tail++){
+		struct trace_event copy;
+		if(!trace_read(trace.tail, &copy)){
+			if(head - trace.tail < 64)
+				break; // still being written, next time
+			trace.lost++;
+			continue;
+		}
+		if(copy.ts >= oldest){
+			if(first == G_MAXUINT64)
+				first = copy.ts;
+			trace_write_event(&copy);
+		}
+	}
+	fflush(trace.file);
+	return first;
+}
+
+static gboolean trace_flush(gpointer data){
+	trace_drain(0);
+	return TRUE;
+}
+
+static bool trace_open(const char *filename){
+	trace.file = fopen(filename, "w");
+	if(trace.file == NULL){
+		printf("could not open trace file %s\n", filename);
+		return false;
+	}
+	trace.first_event = true;
+	g_hash_table_remove_all(trace.tids);
+	fprintf(trace.file, "[\n");
+	/* something to start the array with */
+	trace_write_thread_name(getpid());
+	return true;
+}
+
+static void trace_close(void){
+	fprintf(trace.file, "\n]\n");
+	fclose(trace.file);
+	trace.file = NULL;
+}
+
+/* trace.json becomes trace.3.json, so no dump overwrites another */
+static gchar * trace_dump_name(const char *what){
+	if(g_str_has_suffix(trace.filename, ".json"))
+		return g_strdup_printf("%.*s.%s.json", (int) strlen(trace.filename) - 5, trace.filename, what);
+	return g_strdup_printf("%s.%s", trace.filename, what);
+}
+
+/* ring mode, last ring seconds to a file of their own */
+static void trace_dump_to(const char *what){
+	uint64_t head = __atomic_load_n(&trace.head, __ATOMIC_ACQUIRE);
+	uint64_t start = head > trace.size ? head - trace.size : 0;
+	struct trace_event newest;
+	uint64_t idx;
+	/* the last slots may still be being written */
+	for(idx = head ; idx > start ; idx--)
+		if(trace_read(idx - 1, &newest))
+			break;
+	if(idx == start)
+		return;
+	uint64_t window = (uint64_t) trace.ring * GST_SECOND;
+	uint64_t oldest = newest.ts > window ? newest.ts - window : 0;
+	gchar *filename = trace_dump_name(what);
+	if(!trace_open(filename)){
+		g_free(filename);
+		return;
+	}
+	trace.tail = start;
+	uint64_t first = trace_drain(oldest);
+	trace_close();
+	if(start > 0 && first != G_MAXUINT64 && first > oldest)
+		printf("trace: ring only held the last %.1f of %u seconds, wrote them to %s\n",
+			(newest.ts - first) / (double) GST_SECOND, trace.ring, filename);
+	else
+		printf("trace: wrote last %u seconds to %s\n", trace.ring, filename);
+	g_free(filename);
+}
+
+static gboolean trace_dump(gpointer data){
+	char what[16];
+	snprintf(what, sizeof(what), "%u", ++trace.dumps);
+	trace_dump_to(what);
+	return TRUE;
+}
+
+bool trace_start(struct trace_options *opt){
+	trace.filename = opt->filename;
+	trace.ring = opt->ring;
+	trace.size = trace.ring > 0 ? (uint64_t) trace.ring * TRACE_EVENTS_PER_SECOND : TRACE_RING_EVENTS;
+	trace.events = g_new0(struct trace_event, trace.size);
+	for(uint64_t i = 0 ; i < trace.size ; i++)
+		trace.events[i].seq = G_MAXUINT64;
+	trace.tids = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	if(trace.ring == 0){
+		if(!trace_open(trace.filename))
+			return false;
+		g_timeout_add_seconds(1, trace_flush, NULL);
+		printf("trace: writing to %s\n", trace.filename);
+	} else {
+		g_unix_signal_add(SIGUSR1, trace_dump, NULL);
+		gchar *first = trace_dump_name("1");
+		printf("trace: keeping %u seconds in %lu events, kill -USR1 %d writes %s and on\n", trace.ring,
+			(unsigned long) trace.size, getpid(), first);
+		g_free(first);
+	}
+	/* hooks work from the moment they are registered */
+	trace.tracer = g_object_new(bitcorder_tracer_get_type(), NULL);
+	return true;
+}
+
+void trace_stop(void){
+	if(trace.events == NULL)
+		return;
+	if(trace.ring == 0 && trace.file != NULL){
+		trace_drain(0);
+		trace_close();
+	} else if(trace.ring > 0){
+		/* apart from the SIGUSR1 dumps, which are usually the ones wanted */
+		trace_dump_to("exit");
+	}
+	if(trace.lost > 0)
+		printf("trace: %lu events lost, ring was full\n", (unsigned long) trace.lost);
+}
@@ -0,0 +1,47 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITCORDER_TRACE_H
+#define BITCORDER_TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gst/gst.h>
+
+/* Timeline of every buffer going into every element, as Chrome trace
+ * event JSON that Perfetto and chrome://tracing can open. A tracer hook
+ * records when each push into an element starts and ends, from the thread
+ * that does it, into a ring in memory. Normally the ring is written to
+ * the file every second. In ring mode only the last few seconds are kept,
+ * and they are written when the process gets SIGUSR1, so it can be left
+ * on all the time. Each dump gets its own file, trace.json gives
+ * trace.1.json, trace.2.json and so on, and trace.exit.json at the end. */
+
+#define TRACE_RING_EVENTS (1 << 18)		// written out every second
+#define TRACE_EVENTS_PER_SECOND (1 << 15)	// ring mode, times the seconds kept
+
+struct trace_options {
+	char * filename;
+	uint32_t ring;		// seconds to keep, 0 writes everything
+};
+
+/* after gst_init */
+bool trace_start(struct trace_options *opt);
+/* writes whatever is left and closes the file */
+void trace_stop(void);
+
+#endif
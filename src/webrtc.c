@@ -0,0 +1,651 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gio/gio.h>
+#define GST_USE_UNSTABLE_API
+#include <gst/webrtc/webrtc.h>
+#include <gst/sdp/sdp.h>
+#include "webrtc.h"
+
+#define WEBRTC_VIDEO_PT 96
+#define WEBRTC_AUDIO_PT 97
+#define WEBRTC_PEER_QUEUE_MS 200	// a viewer this far behind drops instead of holding up the rest
+#define WEBRTC_GATHER_TIMEOUT 5		// seconds to collect candidates for the offer
+#define WEBRTC_ANSWER_TIMEOUT 30	// seconds to wait for the browser to answer
+#define WEBRTC_REQUEST_MAX 65536
+
+enum peer_state { PEER_FREE = 0, PEER_OFFERED, PEER_ANSWERED, PEER_CLOSING };
+
+struct webrtc_peer {
+	struct webrtc_output *out;
+	enum peer_state state;
+	uint32_t id;
+	gint64 created;
+	bool gathered;
+	GstElement *webrtcbin;
+	GstElement *videoqueue;
+	GstElement *audioqueue;
+	GstPad *videoteepad;
+	GstPad *audioteepad;
+	gint unlinking;		// tee pads left to unlink while closing
+	guint64 bytes_sent;	// at the last stats
+	gint64 last_time;
+};
+
+struct webrtc_output {
+	GstElement *pipeline;
+	GstElement *videotee;	// RTP, payloaded once for everyone
+	GstElement *audiotee;
+	struct webrtc_options opt;
+	GThreadedSocketService *service;
+	GMutex lock;		// peer states
+	GCond cond;
+	uint32_t next_id;
+	struct webrtc_peer peer[WEBRTC_MAX_PEERS];
+};
+
+struct peer_stats {
+	guint64 bytes_sent;
+	gint64 packets_lost;
+	double fraction_lost;	// worst stream
+	double rtt;
+	guint pli;
+	guint nack;
+};
+
+struct stats_request {
+	struct webrtc_peer *peer;
+	uint32_t id;
+};
+
+static const char viewer_page[] =
+	"<!doctype html>\n<title>bitcorder</title>\n"
+	"<video id=v autoplay playsinline muted controls style=\"width:100%\"></video>\n"
+	"<script>\n"
+	"(async () => {\n"
+	"  const r = await fetch('/peer', {method: 'POST'});\n"
+	"  if(!r.ok){ document.title = 'bitcorder: ' + r.status; return; }\n"
+	"  const where = r.headers.get('Location');\n"
+	"  const pc = new RTCPeerConnection();\n"
+	"  const ms = new MediaStream();\n"
+	"  v.srcObject = ms;\n"
+	"  pc.ontrack = e => ms.addTrack(e.track);\n"
+	"  await pc.setRemoteDescription({type: 'offer', sdp: await r.text()});\n"
+	"  await pc.setLocalDescription(await pc.createAnswer());\n"
+	"  await new Promise(done => {\n"
+	"    if(pc.iceGatheringState == 'complete') done();\n"
+	"    pc.onicegatheringstatechange = () => { if(pc.iceGatheringState == 'complete') done(); };\n"
+	"  });\n"
+	"  await fetch(where, {method: 'POST', body: pc.localDescription.sdp});\n"
+	"  addEventListener('pagehide', () => fetch(where, {method: 'DELETE', keepalive: true}));\n"
+	"})();\n"
+	"</script>\n";
+
+/* Offer exactly what the payloader makes. Before the first frame there are
+ * no caps yet, so offer the plain codec. */
+static GstCaps * branch_caps(GstElement *tee, const char *fallback){
+	GstPad *teesink = gst_element_get_static_pad(tee, "sink");
+	GstCaps *caps = gst_pad_get_current_caps(teesink);
+	gst_object_unref(teesink);
+	if(caps == NULL)
+		return gst_caps_from_string(fallback);
+	caps = gst_caps_make_writable(caps);
+	gst_structure_remove_fields(gst_caps_get_structure(caps, 0),
+		"ssrc", "timestamp-offset", "seqnum-offset", NULL);
+	return caps;
+}
+
+/* tee ! queue ! webrtcbin, send only */
+static GstElement * peer_branch(struct webrtc_peer *peer, GstElement *tee, GstPad **teepad,
+		const char *fallback){
+	GstElement *queue = gst_element_factory_make("queue", NULL);
+	g_object_set(G_OBJECT(queue), "leaky", 2 /* downstream */, "max-size-buffers", 0,
+		"max-size-bytes", 0, "max-size-time", (guint64) WEBRTC_PEER_QUEUE_MS * GST_MSECOND, NULL);
+	gst_bin_add(GST_BIN(peer->out->pipeline), queue);
+
+	GstPad *webrtcsink = gst_element_get_request_pad(peer->webrtcbin, "sink_%u");
+	GstWebRTCRTPTransceiver *transceiver = NULL;
+	g_object_get(G_OBJECT(webrtcsink), "transceiver", &transceiver, NULL);
+	GstCaps *caps = branch_caps(tee, fallback);
+	g_object_set(G_OBJECT(transceiver), "direction", GST_WEBRTC_RTP_TRANSCEIVER_DIRECTION_SENDONLY,
+		"codec-preferences", caps, NULL);
+	gst_caps_unref(caps);
+	gst_object_unref(transceiver);
+
+	GstPad *queuesrc = gst_element_get_static_pad(queue, "src");
+	gst_pad_link(queuesrc, webrtcsink);
+	gst_object_unref(queuesrc);
+	gst_object_unref(webrtcsink);
+	gst_element_sync_state_with_parent(queue);
+
+	*teepad = gst_element_get_request_pad(tee, "src_%u");
+	GstPad *queuesink = gst_element_get_static_pad(queue, "sink");
+	gst_pad_link(*teepad, queuesink);
+	gst_object_unref(queuesink);
+	return queue;
+}
+
+/* a new viewer can't start decoding until the next IDR */
+static void request_keyframe(struct webrtc_peer *peer){
+	GstPad *queuesrc = gst_element_get_static_pad(peer->videoqueue, "src");
+	GstStructure *s = gst_structure_new("GstForceKeyUnit", "all-headers", G_TYPE_BOOLEAN, TRUE, NULL);
+	gst_pad_send_event(queuesrc, gst_event_new_custom(GST_EVENT_CUSTOM_UPSTREAM, s));
+	gst_object_unref(queuesrc);
+}
+
+static void peer_gathering(GstElement *webrtcbin, GParamSpec *pspec, gpointer data){
+	struct webrtc_peer *peer = data;
+	GstWebRTCICEGatheringState state;
+	g_object_get(G_OBJECT(webrtcbin), "ice-gathering-state", &state, NULL);
+	if(state == GST_WEBRTC_ICE_GATHERING_STATE_COMPLETE){
+		g_mutex_lock(&peer->out->lock);
+		peer->gathered = true;
+		g_cond_broadcast(&peer->out->cond);
+		g_mutex_unlock(&peer->out->lock);
+	}
+}
+
+/* main thread, once nothing flows into the peer's branches */
+static gboolean peer_dispose(gpointer data){
+	struct webrtc_peer *peer = data;
+	struct webrtc_output *out = peer->out;
+	if(peer->videoteepad != NULL){
+		gst_element_release_request_pad(out->videotee, peer->videoteepad);
+		gst_object_unref(peer->videoteepad);
+	}
+	if(peer->audioteepad != NULL){
+		gst_element_release_request_pad(out->audiotee, peer->audioteepad);
+		gst_object_unref(peer->audioteepad);
+	}
+	GstElement *elements[] = { peer->videoqueue, peer->audioqueue, peer->webrtcbin };
+	for(int i = 0 ; i < 3 ; i++){
+		if(elements[i] == NULL)
+			continue;
+		gst_element_set_state(elements[i], GST_STATE_NULL);
+		gst_bin_remove(GST_BIN(out->pipeline), elements[i]);
+	}
+	g_mutex_lock(&out->lock);
+	peer->state = PEER_FREE;
+	g_mutex_unlock(&out->lock);
+	return G_SOURCE_REMOVE;
+}
+
+static GstPadProbeReturn peer_unlink_probe(GstPad *teepad, GstPadProbeInfo *info, gpointer data){
+	struct webrtc_peer *peer = data;
+	GstPad *queuesink = gst_pad_get_peer(teepad);
+	if(queuesink != NULL){
+		gst_pad_unlink(teepad, queuesink);
+		gst_object_unref(queuesink);
+	}
+	if(g_atomic_int_dec_and_test(&peer->unlinking))
+		g_idle_add(peer_dispose, peer);
+	return GST_PAD_PROBE_REMOVE;
+}
+
+/* any thread */
+static void peer_close(struct webrtc_peer *peer){
+	g_mutex_lock(&peer->out->lock);
+	if(peer->state == PEER_FREE || peer->state == PEER_CLOSING){
+		g_mutex_unlock(&peer->out->lock);
+		return;
+	}
+	peer->state = PEER_CLOSING;
+	g_mutex_unlock(&peer->out->lock);
+	printf("webrtc viewer %u gone\n", peer->id);
+
+	g_atomic_int_set(&peer->unlinking, 1); // until both probes are on
+	if(peer->videoteepad != NULL){
+		g_atomic_int_inc(&peer->unlinking);
+		gst_pad_add_probe(peer->videoteepad, GST_PAD_PROBE_TYPE_IDLE, peer_unlink_probe, peer, NULL);
+	}
+	if(peer->audioteepad != NULL){
+		g_atomic_int_inc(&peer->unlinking);
+		gst_pad_add_probe(peer->audioteepad, GST_PAD_PROBE_TYPE_IDLE, peer_unlink_probe, peer, NULL);
+	}
+	if(g_atomic_int_dec_and_test(&peer->unlinking))
+		g_idle_add(peer_dispose, peer);
+}
+
+/* Adds a viewer and makes its offer, candidates included. Runs in a
+ * signaling thread, so it can wait on the promises. */
+static gchar * peer_new(struct webrtc_output *out, uint32_t *id){
+	struct webrtc_peer *peer = NULL;
+	g_mutex_lock(&out->lock);
+	for(uint32_t i = 0 ; i < out->opt.peers ; i++){
+		if(out->peer[i].state == PEER_FREE){
+			peer = &out->peer[i];
+			break;
+		}
+	}
+	if(peer == NULL){
+		g_mutex_unlock(&out->lock);
+		printf("webrtc already has %u viewers\n", out->opt.peers);
+		return NULL;
+	}
+	memset(peer, 0, sizeof(*peer));
+	peer->out = out;
+	peer->state = PEER_OFFERED;
+	peer->id = ++out->next_id;
+	peer->created = g_get_monotonic_time();
+	g_mutex_unlock(&out->lock);
+
+	gchar *name = g_strdup_printf("webrtc%u", peer->id);
+	peer->webrtcbin = gst_element_factory_make("webrtcbin", name);
+	g_free(name);
+	if(peer->webrtcbin == NULL){
+		printf("no webrtcbin, it is in gst-plugins-bad\n");
+		g_mutex_lock(&out->lock);
+		peer->state = PEER_FREE;
+		g_mutex_unlock(&out->lock);
+		return NULL;
+	}
+	g_object_set(G_OBJECT(peer->webrtcbin), "bundle-policy", GST_WEBRTC_BUNDLE_POLICY_MAX_BUNDLE, NULL);
+	if(out->opt.stun != NULL)
+		g_object_set(G_OBJECT(peer->webrtcbin), "stun-server", out->opt.stun, NULL);
+	g_signal_connect(peer->webrtcbin, "notify::ice-gathering-state", G_CALLBACK(peer_gathering), peer);
+	gst_bin_add(GST_BIN(out->pipeline), peer->webrtcbin);
+	gst_element_sync_state_with_parent(peer->webrtcbin);
+
+	peer->videoqueue = peer_branch(peer, out->videotee, &peer->videoteepad,
+		"application/x-rtp,media=video,encoding-name=H264,clock-rate=90000,payload=96,"
+		"packetization-mode=(string)1");
+	if(out->audiotee != NULL)
+		peer->audioqueue = peer_branch(peer, out->audiotee, &peer->audioteepad,
+			"application/x-rtp,media=audio,encoding-name=OPUS,clock-rate=48000,payload=97,"
+			"encoding-params=(string)2");
+
+	GstWebRTCSessionDescription *offer = NULL;
+	GstPromise *promise = gst_promise_new();
+	g_signal_emit_by_name(peer->webrtcbin, "create-offer", NULL, promise);
+	if(gst_promise_wait(promise) == GST_PROMISE_RESULT_REPLIED)
+		gst_structure_get(gst_promise_get_reply(promise), "offer",
+			GST_TYPE_WEBRTC_SESSION_DESCRIPTION, &offer, NULL);
+	gst_promise_unref(promise);
+	if(offer == NULL){
+		printf("webrtc viewer %u: no offer\n", peer->id);
+		peer_close(peer);
+		return NULL;
+	}
+	promise = gst_promise_new();
+	g_signal_emit_by_name(peer->webrtcbin, "set-local-description", offer, promise);
+	bool set = gst_promise_wait(promise) == GST_PROMISE_RESULT_REPLIED;
+	/* webrtcbin replies with an error field when it refuses the description */
+	if(set && gst_promise_get_reply(promise) != NULL
+			&& gst_structure_has_field(gst_promise_get_reply(promise), "error"))
+		set = false;
+	gst_promise_unref(promise);
+	gst_webrtc_session_description_free(offer);
+	if(!set){
+		printf("webrtc viewer %u: can't set local description\n", peer->id);
+		peer_close(peer);
+		return NULL;
+	}
+
+	/* no trickle, so every candidate has to be in the offer */
+	gint64 until = g_get_monotonic_time() + WEBRTC_GATHER_TIMEOUT * G_TIME_SPAN_SECOND;
+	g_mutex_lock(&out->lock);
+	while(!peer->gathered){
+		if(!g_cond_wait_until(&out->cond, &out->lock, until)){
+			printf("webrtc viewer %u: still gathering candidates, offering what there is\n", peer->id);
+			break;
+		}
+	}
+	g_mutex_unlock(&out->lock);
+
+	GstWebRTCSessionDescription *local = NULL;
+	g_object_get(G_OBJECT(peer->webrtcbin), "local-description", &local, NULL);
+	if(local == NULL){
+		printf("webrtc viewer %u: no local description\n", peer->id);
+		peer_close(peer);
+		return NULL;
+	}
+	gchar *sdp = gst_sdp_message_as_text(local->sdp);
+	gst_webrtc_session_description_free(local);
+	*id = peer->id;
+	printf("webrtc viewer %u offered\n", peer->id);
+	return sdp;
+}
+
+/* takes a ref on the webrtcbin so it outlives a close from another thread */
+static struct webrtc_peer * peer_find(struct webrtc_output *out, uint32_t id, GstElement **webrtcbin){
+	struct webrtc_peer *found = NULL;
+	g_mutex_lock(&out->lock);
+	for(uint32_t i = 0 ; i < out->opt.peers ; i++){
+		struct webrtc_peer *peer = &out->peer[i];
+		if(peer->id == id && (peer->state == PEER_OFFERED || peer->state == PEER_ANSWERED)
+				&& peer->webrtcbin != NULL){
+			found = peer;
+			*webrtcbin = gst_object_ref(peer->webrtcbin);
+			break;
+		}
+	}
+	g_mutex_unlock(&out->lock);
+	return found;
+}
+
+/* returns the HTTP status for the answer */
+static const char * peer_answer(struct webrtc_output *out, uint32_t id, const char *body){
+	GstElement *webrtcbin;
+	struct webrtc_peer *peer = peer_find(out, id, &webrtcbin);
+	if(peer == NULL)
+		return "404 Not Found";
+	GstSDPMessage *sdp;
+	gst_sdp_message_new(&sdp);
+	if(gst_sdp_message_parse_buffer((const guint8 *) body, strlen(body), sdp) != GST_SDP_OK){
+		printf("webrtc viewer %u: bad answer\n", id);
+		gst_sdp_message_free(sdp);
+		gst_object_unref(webrtcbin);
+		peer_close(peer);
+		return "400 Bad Request";
+	}
+	GstWebRTCSessionDescription *answer = gst_webrtc_session_description_new(GST_WEBRTC_SDP_TYPE_ANSWER, sdp);
+	GstPromise *promise = gst_promise_new();
+	g_signal_emit_by_name(webrtcbin, "set-remote-description", answer, promise);
+	bool set = gst_promise_wait(promise) == GST_PROMISE_RESULT_REPLIED;
+	if(set && gst_promise_get_reply(promise) != NULL
+			&& gst_structure_has_field(gst_promise_get_reply(promise), "error"))
+		set = false;
+	gst_promise_unref(promise);
+	gst_webrtc_session_description_free(answer);
+	gst_object_unref(webrtcbin);
+	if(!set){
+		printf("webrtc viewer %u: answer refused\n", id);
+		peer_close(peer);
+		return "400 Bad Request";
+	}
+
+	g_mutex_lock(&out->lock);
+	if(peer->state == PEER_OFFERED){
+		peer->state = PEER_ANSWERED;
+		peer->last_time = g_get_monotonic_time();
+	}
+	g_mutex_unlock(&out->lock);
+	request_keyframe(peer);
+	printf("webrtc viewer %u answered\n", id);
+	return "204 No Content";
+}
+
+static void respond(GOutputStream *os, const char *status, const char *type,
+		const char *extra, const char *body){
+	gsize length = body != NULL ? strlen(body) : 0;
+	gchar *head = g_strdup_printf("HTTP/1.1 %s\r\n"
+		"%s"
+		"Content-Type: %s\r\n"
+		"Content-Length: %zu\r\n"
+		"Connection: close\r\n\r\n",
+		status, extra != NULL ? extra : "", type, length);
+	g_output_stream_write_all(os, head, strlen(head), NULL, NULL, NULL);
+	if(length > 0)
+		g_output_stream_write_all(os, body, length, NULL, NULL, NULL);
+	g_free(head);
+}
+
+/* One request per connection, each in its own thread from the service */
+static gboolean signaling_run(GThreadedSocketService *service, GSocketConnection *connection,
+		GObject *source, gpointer data){
+	struct webrtc_output *out = data;
+	GInputStream *is = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+	GOutputStream *os = g_io_stream_get_output_stream(G_IO_STREAM(connection));
+	char *request = g_malloc(WEBRTC_REQUEST_MAX + 1);
+	gsize got = 0;
+	char *body = NULL;
+
+	while(got < WEBRTC_REQUEST_MAX && body == NULL){
+		gssize n = g_input_stream_read(is, request + got, WEBRTC_REQUEST_MAX - got, NULL, NULL);
+		if(n <= 0)
+			break;
+		got += n;
+		request[got] = '\0';
+		body = strstr(request, "\r\n\r\n");
+	}
+	if(body == NULL){
+		g_free(request);
+		return TRUE;
+	}
+	body += 4;
+	gsize header_length = body - request;
+	gsize content_length = 0;
+	char *field = strcasestr(request, "\r\nContent-Length:");
+	if(field != NULL && field < body)
+		content_length = strtoul(field + strlen("\r\nContent-Length:"), NULL, 10);
+	if(content_length > WEBRTC_REQUEST_MAX - header_length)
+		content_length = WEBRTC_REQUEST_MAX - header_length;
+	while(got < header_length + content_length){
+		gssize n = g_input_stream_read(is, request + got, header_length + content_length - got, NULL, NULL);
+		if(n <= 0)
+			break;
+		got += n;
+	}
+	request[got] = '\0';
+
+	char method[8];
+	char path[64];
+	uint32_t id;
+	if(sscanf(request, "%7s %63s", method, path) != 2){
+		respond(os, "400 Bad Request", "text/plain", NULL, NULL);
+	} else if(strcmp(method, "GET") == 0 && strcmp(path, "/") == 0){
+		respond(os, "200 OK", "text/html", NULL, viewer_page);
+	} else if(strcmp(method, "POST") == 0 && strcmp(path, "/peer") == 0){
+		gchar *offer = peer_new(out, &id);
+		if(offer != NULL){
+			gchar *location = g_strdup_printf("Location: /peer/%u\r\n", id);
+			respond(os, "201 Created", "application/sdp", location, offer);
+			g_free(location);
+			g_free(offer);
+		} else {
+			respond(os, "503 Service Unavailable", "text/plain", NULL, NULL);
+		}
+	} else if(sscanf(path, "/peer/%u", &id) == 1){
+		if(strcmp(method, "DELETE") == 0){
+			GstElement *webrtcbin;
+			struct webrtc_peer *peer = peer_find(out, id, &webrtcbin);
+			if(peer != NULL){
+				gst_object_unref(webrtcbin);
+				peer_close(peer);
+				respond(os, "204 No Content", "text/plain", NULL, NULL);
+			} else {
+				respond(os, "404 Not Found", "text/plain", NULL, NULL);
+			}
+		} else if(strcmp(method, "POST") == 0 || strcmp(method, "PATCH") == 0){
+			respond(os, peer_answer(out, id, body), "text/plain", NULL, NULL);
+		} else {
+			respond(os, "405 Method Not Allowed", "text/plain", NULL, NULL);
+		}
+	} else {
+		respond(os, "404 Not Found", "text/plain", NULL, NULL);
+	}
+	g_free(request);
+	return TRUE;
+}
+
+/* viewers that never answered or whose connection failed */
+static gboolean reap_peers(gpointer data){
+	struct webrtc_output *out = data;
+	gint64 now = g_get_monotonic_time();
+	for(uint32_t i = 0 ; i < out->opt.peers ; i++){
+		struct webrtc_peer *peer = &out->peer[i];
+		g_mutex_lock(&out->lock);
+		enum peer_state state = peer->state;
+		g_mutex_unlock(&out->lock);
+		if(state == PEER_OFFERED && now - peer->created > WEBRTC_ANSWER_TIMEOUT * G_TIME_SPAN_SECOND){
+			printf("webrtc viewer %u never answered\n", peer->id);
+			peer_close(peer);
+		} else if(state == PEER_ANSWERED){
+			GstWebRTCPeerConnectionState connection;
+			g_object_get(G_OBJECT(peer->webrtcbin), "connection-state", &connection, NULL);
+			if(connection == GST_WEBRTC_PEER_CONNECTION_STATE_FAILED
+					|| connection == GST_WEBRTC_PEER_CONNECTION_STATE_CLOSED)
+				peer_close(peer);
+		}
+	}
+	return TRUE;
+}
+
+struct webrtc_output * webrtc_output_new(GstElement *pipeline, GstElement *videnctee,
+		GstElement *opustee, struct webrtc_options *opt){
+	struct webrtc_output *out = g_new0(struct webrtc_output, 1);
+	out->pipeline = pipeline;
+	out->opt = *opt;
+	if(out->opt.peers == 0 || out->opt.peers > WEBRTC_MAX_PEERS)
+		out->opt.peers = WEBRTC_MAX_PEERS;
+	g_mutex_init(&out->lock);
+	g_cond_init(&out->cond);
+
+	GError *error = NULL;
+	if(out->opt.bind == NULL)
+		out->opt.bind = WEBRTC_DEFAULT_BIND;
+	GInetAddress *address = g_inet_address_new_from_string(out->opt.bind);
+	if(address == NULL){
+		printf("webrtc bind=%s is not an IP address\n", out->opt.bind);
+		g_free(out);
+		return NULL;
+	}
+	GSocketAddress *where = g_inet_socket_address_new(address, out->opt.port);
+	g_object_unref(address);
+	out->service = G_THREADED_SOCKET_SERVICE(g_threaded_socket_service_new(out->opt.peers));
+	if(!g_socket_listener_add_address(G_SOCKET_LISTENER(out->service), where, G_SOCKET_TYPE_STREAM,
+			G_SOCKET_PROTOCOL_TCP, NULL, NULL, &error)){
+		printf("webrtc signaling can't listen on %s port %u: %s\n", out->opt.bind, out->opt.port, error->message);
+		g_error_free(error);
+		g_object_unref(where);
+		g_object_unref(out->service);
+		g_free(out);
+		return NULL;
+	}
+	g_object_unref(where);
+
+	/* payload once, every viewer gets a copy of the same packets */
+	GstElement *videoqueue = gst_element_factory_make("queue", "webrtc_video_queue");
+	GstElement *videopay = gst_element_factory_make("rtph264pay", NULL);
+	g_object_set(G_OBJECT(videopay), "config-interval", -1, "pt", WEBRTC_VIDEO_PT,
+		"aggregate-mode", 1 /* zero-latency */, NULL);
+	out->videotee = gst_element_factory_make("tee", "webrtc_video_tee");
+	g_object_set(G_OBJECT(out->videotee), "allow-not-linked", TRUE, NULL);
+	gst_bin_add_many(GST_BIN(pipeline), videoqueue, videopay, out->videotee, NULL);
+	gst_element_link_many(videnctee, videoqueue, videopay, out->videotee, NULL);
+
+	if(opustee != NULL){
+		GstElement *audioqueue = gst_element_factory_make("queue", "webrtc_audio_queue");
+		GstElement *audiopay = gst_element_factory_make("rtpopuspay", NULL);
+		g_object_set(G_OBJECT(audiopay), "pt", WEBRTC_AUDIO_PT, NULL);
+		out->audiotee = gst_element_factory_make("tee", "webrtc_audio_tee");
+		g_object_set(G_OBJECT(out->audiotee), "allow-not-linked", TRUE, NULL);
+		gst_bin_add_many(GST_BIN(pipeline), audioqueue, audiopay, out->audiotee, NULL);
+		gst_element_link_many(opustee, audioqueue, audiopay, out->audiotee, NULL);
+	}
+	// FIXME the browser has to take whatever H.264 profile the encoder makes
+
+	g_signal_connect(out->service, "run", G_CALLBACK(signaling_run), out);
+	g_socket_service_start(G_SOCKET_SERVICE(out->service));
+	g_timeout_add_seconds(5, reap_peers, out);
+	printf("webrtc viewers at http://%s:%u/\n", out->opt.bind, out->opt.port);
+	return out;
+}
+
+static gboolean peer_stats_field(GQuark field, const GValue *value, gpointer data){
+	struct peer_stats *stats = data;
+	if(!GST_VALUE_HOLDS_STRUCTURE(value))
+		return TRUE;
+	const GstStructure *s = gst_value_get_structure(value);
+	GstWebRTCStatsType type;
+	guint64 bytes;
+	gint64 lost;
+	double d;
+	guint count;
+	if(!gst_structure_get(s, "type", GST_TYPE_WEBRTC_STATS_TYPE, &type, NULL))
+		return TRUE;
+	switch(type){
+	case GST_WEBRTC_STATS_OUTBOUND_RTP:
+		if(gst_structure_get_uint64(s, "bytes-sent", &bytes))
+			stats->bytes_sent += bytes;
+		if(gst_structure_get_uint(s, "pli-count", &count))
+			stats->pli += count;
+		if(gst_structure_get_uint(s, "nack-count", &count))
+			stats->nack += count;
+		break;
+	case GST_WEBRTC_STATS_REMOTE_INBOUND_RTP:
+		if(gst_structure_get_int64(s, "packets-lost", &lost))
+			stats->packets_lost += lost;
+		if(gst_structure_get_double(s, "fraction-lost", &d) && d > stats->fraction_lost)
+			stats->fraction_lost = d;
+		if(gst_structure_get_double(s, "round-trip-time", &d) && d > stats->rtt)
+			stats->rtt = d;
+		break;
+	default:
+		break;
+	}
+	return TRUE;
+}
+
+/* webrtcbin thread */
+static void peer_stats_reply(GstPromise *promise, gpointer data){
+	struct stats_request *request = data;
+	struct webrtc_peer *peer = request->peer;
+	struct peer_stats stats = { 0 };
+	if(gst_promise_wait(promise) != GST_PROMISE_RESULT_REPLIED)
+		return;
+	gst_structure_foreach(gst_promise_get_reply(promise), peer_stats_field, &stats);
+
+	g_mutex_lock(&peer->out->lock);
+	if(peer->id != request->id || peer->state != PEER_ANSWERED){
+		g_mutex_unlock(&peer->out->lock);
+		return;
+	}
+	gint64 now = g_get_monotonic_time();
+	double kbits = 0;
+	if(now > peer->last_time && stats.bytes_sent >= peer->bytes_sent)
+		kbits = (stats.bytes_sent - peer->bytes_sent) * 8000.0 / (now - peer->last_time);
+	peer->bytes_sent = stats.bytes_sent;
+	peer->last_time = now;
+	g_mutex_unlock(&peer->out->lock);
+
+	printf("webrtc viewer %u: %.0f kbit/s, %" G_GINT64_FORMAT " packets lost, %.1f%% loss, "
+		"rtt %.0f ms, %u pli, %u nack\n", request->id, kbits, stats.packets_lost,
+		stats.fraction_lost * 100.0, stats.rtt * 1000.0, stats.pli, stats.nack);
+}
+
+gboolean webrtc_print_stats(gpointer data){
+	struct webrtc_output *out = data;
+	uint32_t viewers = 0;
+	for(uint32_t i = 0 ; i < out->opt.peers ; i++){
+		struct webrtc_peer *peer = &out->peer[i];
+		g_mutex_lock(&out->lock);
+		if(peer->state != PEER_ANSWERED){
+			g_mutex_unlock(&out->lock);
+			continue;
+		}
+		GstElement *webrtcbin = gst_object_ref(peer->webrtcbin);
+		struct stats_request *request = g_new0(struct stats_request, 1);
+		request->peer = peer;
+		request->id = peer->id;
+		g_mutex_unlock(&out->lock);
+		viewers++;
+
+		/* the reply prints its own line */
+		GstPromise *promise = gst_promise_new_with_change_func(peer_stats_reply, request, g_free);
+		g_signal_emit_by_name(webrtcbin, "get-stats", NULL, promise);
+		gst_promise_unref(promise);
+		gst_object_unref(webrtcbin);
+	}
+	printf("webrtc viewers: %u\n", viewers);
+	return TRUE;
+}
@@ -0,0 +1,59 @@
+/*  bitcorder A video streaming application
+ *  Copyright (C) 2019 Daniel Patrick Johnson
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Lesser Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BITCORDER_WEBRTC_H
+#define BITCORDER_WEBRTC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <gst/gst.h>
+
+/* WebRTC viewers. The H.264 from the encoder and an Opus encode are each
+ * payloaded once and teed to one webrtcbin per viewer, so a new viewer
+ * costs no encoding. Signaling is plain HTTP on its own port:
+ *
+ *   GET /             a viewer page
+ *   POST /peer        new viewer, the reply is the offer, Location is the peer
+ *   POST /peer/N      the browser's answer
+ *   DELETE /peer/N    viewer left
+ *
+ * ICE is not trickled, the offer and the answer carry their candidates, so
+ * curl is enough to stand in for a browser. There is no authentication, so
+ * it only listens on loopback unless told otherwise. The page and the
+ * signaling are the same origin, so no CORS headers either. */
+
+#define WEBRTC_DEFAULT_PORT 8080
+#define WEBRTC_DEFAULT_BIND "127.0.0.1"	// anyone who can connect gets the screen
+#define WEBRTC_MAX_PEERS 16
+
+struct webrtc_options {
+	uint16_t port;
+	char * bind;		// address to listen on, 0.0.0.0 for every interface
+	uint32_t peers;		// viewers at once, up to WEBRTC_MAX_PEERS
+	char * stun;		// stun://host:port, none for a LAN
+};
+
+struct webrtc_output;
+
+/* opustee can be NULL for video only */
+struct webrtc_output * webrtc_output_new(GstElement *pipeline, GstElement *videnctee,
+	GstElement *opustee, struct webrtc_options *opt);
+
+/* g_timeout_add callback, prints bitrate, loss and round trip per viewer */
+gboolean webrtc_print_stats(gpointer data);
+
+#endif